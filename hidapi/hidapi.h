@@ -28,6 +28,9 @@
 #define HIDAPI_H__
 
 #include <wchar.h>
+#ifdef LINUX_FREEBSD
+#include <stdint.h>
+#endif
 
 #ifdef _WIN32
       #define HID_API_EXPORT __declspec(dllexport)
@@ -64,10 +67,12 @@ extern "C" {
 			/** Product string */
 			wchar_t *product_string;
 			/** Usage Page for this Device/Interface
-			    (Windows/Mac only). */
+			    (Windows/Mac/hidraw only; libusb once the
+			    interface has been opened). */
 			unsigned short usage_page;
 			/** Usage for this Device/Interface
-			    (Windows/Mac only).*/
+			    (Windows/Mac/hidraw only; libusb once the
+			    interface has been opened).*/
 			unsigned short usage;
 			/** The USB interface which this logical device
 			    represents. Valid on both Linux implementations
@@ -118,6 +123,11 @@ extern "C" {
 			If @p vendor_id and @p product_id are both set to 0, then
 			all HID devices will be returned.
 
+			On the hidraw implementation a device with more than one
+			top-level collection is listed once per collection. These
+			records follow each other and have the same path, only
+			usage_page and usage differ.
+
 			@ingroup API
 			@param vendor_id The Vendor ID (VID) of the types of device
 				to open.
@@ -354,6 +364,13 @@ extern "C" {
 
 		/** @brief Close a HID device.
 
+			On the libusb implementation this waits for the event
+			thread, so it must not be called from a callback which
+			runs there: an input report callback, a hid_write_async()
+			callback or a queue overflow callback. Such a call does
+			nothing and sets errno to EDEADLK; close the device from
+			another thread instead.
+
 			@ingroup API
 			@param device A device handle returned from hid_open().
 		*/
@@ -433,6 +450,650 @@ extern "C" {
     #include <windows.h>
         HANDLE HID_API_EXPORT HID_API_CALL get_device_handle(hid_device *dev);
 #endif
+#ifdef LINUX_FREEBSD
+		/** Input report callback, see hid_set_input_report_callback().
+		    @p timestamp is the CLOCK_MONOTONIC time in nanoseconds at
+		    which the report was received. */
+		typedef void (*hid_input_report_callback)(hid_device *dev, unsigned char *data, size_t length, uint64_t timestamp, void *user_data);
+
+		/** @brief Deliver Input reports to a callback as they are received.
+
+			On the libusb implementation the callback is called from the
+			event thread as soon as the transfer completes, and @p data
+			points directly into the transfer buffer. It is only valid
+			for the duration of the call. If @p queue_reports is 0 the
+			report is not copied or queued at all, so hid_read() will
+			not return it. If it is 1, a copy is also queued for
+			hid_read() as usual.
+
+			The event thread is shared by all open devices, so the
+			callback should not block, and it must not call
+			hid_close().
+
+			On the hidraw implementation there is no event thread; the
+			callback is called from hid_read() and hid_read_timeout()
+			with the buffer the report was read into.
+
+			On the libusb implementation the callback may be changed at
+			any time. Once this function returns, the previous callback
+			is not running and will not be called again (unless this
+			function is called from it), so its @p user_data may be
+			freed. Reports received while it is being changed are
+			queued. On the hidraw implementation change it from the
+			thread which reads. Pass NULL as @p callback to go back to
+			queued delivery.
+
+			@ingroup API
+			@param device A device handle returned from hid_open().
+			@param callback The function to call for every Input report,
+				or NULL.
+			@param user_data Passed through to @p callback.
+			@param queue_reports Whether to also queue the reports for
+				hid_read().
+
+			@returns
+				This function returns 0 on success and -1 on error.
+		*/
+		int HID_API_EXPORT HID_API_CALL hid_set_input_report_callback(hid_device *device, hid_input_report_callback callback, void *user_data, int queue_reports);
+
+		/** What to do with an Input report when the queue is full,
+		    see hid_set_input_queue(). */
+		enum hid_queue_policy {
+			/** Drop the oldest queued report (the default). */
+			HID_QUEUE_DROP_OLDEST,
+			/** Drop the report which was just received. */
+			HID_QUEUE_DROP_NEWEST,
+			/** Keep only the latest report of each report ID: a
+			    new report replaces a queued one with the same ID,
+			    in its place. Otherwise the oldest is dropped if
+			    the queue is full. */
+			HID_QUEUE_COALESCE,
+			/** Stop reading from the device until hid_read() has
+			    made room, so the device has to hold on to its
+			    reports. Nothing is dropped. */
+			HID_QUEUE_BLOCK
+		};
+
+		/** Overflow callback, see hid_set_input_queue(). @p data is
+		    the report which was dropped (or held back, with
+		    #HID_QUEUE_BLOCK) and is only valid during the call. */
+		typedef void (*hid_queue_overflow_callback)(hid_device *dev, const unsigned char *data, size_t length, void *user_data);
+
+		/** @brief Configure the queue of Input reports of a device.
+
+			Received reports are queued until hid_read() returns
+			them. A deep queue suits a logger, which must not lose
+			any report; a shallow one with #HID_QUEUE_COALESCE or
+			#HID_QUEUE_DROP_OLDEST suits real-time control, which
+			only wants the latest values. The default is a capacity
+			of 32 with #HID_QUEUE_DROP_OLDEST.
+
+			The queued reports are kept, as far as they fit. Reports
+			received while the queue is being changed are dropped.
+			Do not call this while another thread reads from the
+			device.
+
+			@p callback is called from the event thread whenever the
+			queue is full. It should not block, and must not call
+			hidapi functions on @p device.
+
+			Only available in the libusb implementation. hidraw
+			queues the reports in the kernel, and this returns -1
+			with errno set to ENOTSUP.
+
+			@ingroup API
+			@param device A device handle returned from hid_open().
+			@param capacity The number of reports the queue holds, a
+				power of 2 from 1 to 1024.
+			@param policy What to do when the queue is full.
+			@param callback The function to call on overflow, or NULL.
+			@param user_data Passed through to @p callback.
+
+			@returns
+				This function returns 0 on success and -1 on error.
+		*/
+		int HID_API_EXPORT HID_API_CALL hid_set_input_queue(hid_device *device, int capacity, enum hid_queue_policy policy, hid_queue_overflow_callback callback, void *user_data);
+
+		/** @brief Read an Input report together with the time it was received.
+
+			Same as hid_read_timeout(), but also returns the
+			CLOCK_MONOTONIC time at which the report was received. On
+			the libusb implementation it is taken in the transfer
+			callback, so it doesn't include the time the report spent
+			in the queue. On the hidraw implementation it is taken
+			right after read().
+
+			@ingroup API
+			@param device A device handle returned from hid_open().
+			@param data A buffer to put the read data into.
+			@param length The number of bytes to read. For devices with
+				multiple reports, make sure to read an extra byte for
+				the report number.
+			@param timestamp Set to the receive time in nanoseconds
+				if a report was read (may be NULL).
+			@param milliseconds timeout in milliseconds or -1 for blocking wait.
+
+			@returns
+				This function returns the actual number of bytes read and
+				-1 on error. If no packet was available to be read within
+				the timeout period, this function returns 0.
+		*/
+		int HID_API_EXPORT HID_API_CALL hid_read_timestamped(hid_device *device, unsigned char *data, size_t length, uint64_t *timestamp, int milliseconds);
+
+		/** @brief Read all queued Input reports from a HID device.
+
+			Waits like hid_read_timeout() for the first report, then
+			returns every report which is already queued, up to
+			@p max_reports, without waiting any further. Report @p i is
+			put at @p data + @p i * @p stride and its length in
+			@p lengths[i]. This costs one lock (libusb) or one poll()
+			(hidraw) per call instead of one per report.
+
+			@ingroup API
+			@param device A device handle returned from hid_open().
+			@param data A buffer of at least @p stride * @p max_reports
+				bytes to put the reports into.
+			@param stride The space for each report. Longer reports are
+				truncated.
+			@param max_reports The maximum number of reports to return.
+			@param lengths An array of @p max_reports ints to put the
+				length of each report into.
+			@param milliseconds timeout in milliseconds or -1 for blocking wait.
+
+			@returns
+				This function returns the number of reports read and
+				-1 on error. If no report was available to be read within
+				the timeout period, this function returns 0.
+		*/
+		int HID_API_EXPORT HID_API_CALL hid_read_batch(hid_device *device, unsigned char *data, size_t stride, int max_reports, int *lengths, int milliseconds);
+
+		/** Completion callback of hid_write_async(). @p result is what
+		    hid_write() would have returned. */
+		typedef void (*hid_write_callback)(hid_device *dev, int result, void *user_data);
+
+		/** @brief Write an Output report without waiting for it.
+
+			Like hid_write(), but on the libusb implementation the
+			report is copied into one of a few preallocated
+			transfers, submitted, and the function returns right
+			away. @p callback is called from the event thread once
+			the transfer is done, and can write again. Up to 8 writes
+			can be in flight per device. Writes which are still in
+			flight in hid_close() are cancelled, their callback gets
+			-1.
+
+			On the hidraw implementation the report is written
+			right away, blocking until the device has taken it, and
+			@p callback is called before this function returns. It
+			returns -1 if that write failed.
+
+			@ingroup API
+			@param device A device handle returned from hid_open().
+			@param data The data to send, including the report number as
+				the first byte.
+			@param length The length in bytes of the data to send.
+			@param callback The function to call when the write is done,
+				or NULL.
+			@param user_data Passed to @p callback.
+
+			@returns
+				This function returns 0 if the write was submitted and
+				-1 on error. errno is EAGAIN if all the transfers are
+				in flight.
+		*/
+		int HID_API_EXPORT HID_API_CALL hid_write_async(hid_device *device, const unsigned char *data, size_t length, hid_write_callback callback, void *user_data);
+
+		/** @brief Queue an Output report, replacing an older one.
+
+			The report is sent with hid_write() by a writer thread,
+			which is started by the first call. If a report with the
+			same Report ID (the first byte of @p data) is still
+			waiting to be sent, it is replaced, so only the newest
+			report per Report ID is ever sent. This suits reports
+			which set a state, like LEDs, which are produced faster
+			than the device takes them. Reports which are still
+			waiting in hid_close() are dropped.
+
+			@ingroup API
+			@param device A device handle returned from hid_open().
+			@param data The data to send, including the report number as
+				the first byte.
+			@param length The length in bytes of the data to send.
+
+			@returns
+				This function returns @p length if the report was
+				queued and -1 on error.
+		*/
+		int HID_API_EXPORT HID_API_CALL hid_write_latest(hid_device *device, const unsigned char *data, size_t length);
+
+		/** @brief Keep the list of devices in memory.
+
+			With the cache enabled, the devices are scanned once and
+			the list is then kept current by a udev monitor, so
+			hid_enumerate() (and hid_open()) no longer walk sysfs on
+			every call. hid_exit() disables the cache again.
+			Only available in the hidraw implementation, elsewhere
+			it fails with errno set to ENOTSUP.
+
+			@ingroup API
+			@param enable 1 to enable the cache, 0 to disable and
+				free it.
+
+			@returns
+				This function returns 0 on success and -1 on error.
+		*/
+		int HID_API_EXPORT HID_API_CALL hid_set_enumeration_cache(int enable);
+
+		/** @brief Enumerate by reading sysfs directly instead of through udev.
+
+			hid_enumerate() then reads the uevent files under
+			/sys/class/hidraw itself, and only reads the USB
+			attributes of devices which match the VID/PID. The
+			records are the same, but may come in a different
+			order. A cache enabled with hid_set_enumeration_cache()
+			takes precedence. Only available in the hidraw
+			implementation, elsewhere it fails with errno set to
+			ENOTSUP.
+
+			@ingroup API
+			@param enable 1 to read sysfs directly, 0 to use udev
+				(the default).
+
+			@returns
+				This function returns 0 on success and -1 on error.
+		*/
+		int HID_API_EXPORT HID_API_CALL hid_set_enumeration_sysfs(int enable);
+
+		/** @brief Set how many Input transfers are kept submitted.
+
+			Every device keeps this many interrupt transfers
+			submitted on its Input endpoint, so there is always one
+			pending while a completed one is handled. Fast devices
+			(several kHz) need a few to not lose reports. Only
+			affects devices opened afterwards, and only available in
+			the libusb implementation, elsewhere it fails with errno
+			set to ENOTSUP.
+
+			@ingroup API
+			@param count The number of transfers, from 1 to 32. The
+				default is 4.
+
+			@returns
+				This function returns 0 on success and -1 on error.
+		*/
+		int HID_API_EXPORT HID_API_CALL hid_set_input_transfers(int count);
+
+		/** @brief Enumerate the HID Devices with a given usage.
+
+			Like hid_enumerate(), but only returns the records whose
+			Usage Page and Usage match. The hidraw implementation
+			reads the usages from the report descriptors in sysfs,
+			without opening any device, and returns one record per
+			top-level collection. The libusb implementation only knows
+			the usages of interfaces opened before (or all of them
+			if built with INVASIVE_GET_USAGE).
+
+			@ingroup API
+			@param vendor_id The Vendor ID (VID) of the types of device
+				to open, or 0 for any.
+			@param product_id The Product ID (PID) of the types of
+				device to open, or 0 for any.
+			@param usage_page The Usage Page to match, or 0 for any.
+			@param usage The Usage to match, or 0 for any.
+
+			@returns
+				This function returns a pointer to a linked list of type
+				struct #hid_device_info, or NULL if no matching device
+				was found. Free it with hid_free_enumeration().
+		*/
+		struct hid_device_info HID_API_EXPORT * HID_API_CALL hid_enumerate_usage(unsigned short vendor_id, unsigned short product_id, unsigned short usage_page, unsigned short usage);
+
+		/** Runtime statistics of a device, see hid_get_stats(). */
+		struct hid_device_stats {
+			/** Input reports received */
+			uint64_t reports_received;
+			/** Bytes of Input reports received */
+			uint64_t bytes_received;
+			/** Input reports dropped because the queue was full
+			    (libusb only) */
+			uint64_t reports_dropped;
+			/** Largest number of queued Input reports (libusb only) */
+			uint64_t max_queue_depth;
+			/** read() calls on the device (hidraw), or hid_read*()
+			    calls (libusb) */
+			uint64_t read_calls;
+			/** hid_write() calls */
+			uint64_t writes;
+			/** Total and largest time spent in hid_write(), in
+			    nanoseconds */
+			uint64_t write_time_ns;
+			uint64_t max_write_time_ns;
+			/** Reports parsed by hidapi_parser, and the total time
+			    it took, in nanoseconds. Only counted while
+			    hid_get_parse_timing() is true. */
+			uint64_t reports_parsed;
+			uint64_t parse_time_ns;
+			/** Reports of hid_write_latest() which were replaced by a
+			    newer one before they were sent */
+			uint64_t writes_replaced;
+			/** Input reports which replaced a queued one with
+			    #HID_QUEUE_COALESCE (libusb only) */
+			uint64_t reports_coalesced;
+		};
+
+		/** @brief Get the runtime statistics of a device.
+
+			The counters start at 0 when the device is opened, and are
+			updated with relaxed atomic operations, so reading them
+			from another thread is fine.
+
+			@ingroup API
+			@param device A device handle returned from hid_open().
+			@param stats Set to the current counters.
+
+			@returns
+				This function returns 0 on success and -1 on error.
+		*/
+		int HID_API_EXPORT HID_API_CALL hid_get_stats(hid_device *device, struct hid_device_stats *stats);
+
+		/** @brief Add the time spent parsing a report to the statistics.
+
+			Called by hidapi_parser for every parsed Input report,
+			if hid_get_parse_timing() is true.
+
+			@ingroup API
+			@param device A device handle returned from hid_open().
+			@param nanoseconds The time it took to parse the report.
+		*/
+		void HID_API_EXPORT HID_API_CALL hid_stats_add_parse_time(hid_device *device, uint64_t nanoseconds);
+
+		/** @brief Enable or disable timing the parsing of Input reports.
+
+			Timing takes two clock reads per report, so hidapi_parser
+			only does it when asked to. It is off by default.
+
+			@ingroup API
+			@param device A device handle returned from hid_open().
+			@param enable 1 to time the parsing, 0 to stop.
+
+			@returns
+				This function returns 0 on success and -1 on error.
+		*/
+		int HID_API_EXPORT HID_API_CALL hid_set_parse_timing(hid_device *device, int enable);
+
+		/** @brief Check whether the parsing of Input reports is timed.
+
+			@ingroup API
+			@param device A device handle returned from hid_open().
+
+			@returns
+				This function returns 1 if parse timing or the
+				histograms (see hid_set_histograms()) are enabled, and
+				0 otherwise.
+		*/
+		int HID_API_EXPORT HID_API_CALL hid_get_parse_timing(hid_device *device);
+
+		/** Number of buckets in a struct #hid_histogram. */
+		#define HID_HISTOGRAM_BUCKETS 252
+
+		/** Latency histograms of a device, see hid_get_histogram(). */
+		enum hid_histogram_type {
+			/** Time between two consecutive Input reports */
+			HID_HISTOGRAM_REPORT_INTERVAL,
+			/** Time an Input report spent in the queue, from
+			    receipt to hid_read() (libusb only) */
+			HID_HISTOGRAM_QUEUE_LATENCY,
+			/** Time spent in hid_write() */
+			HID_HISTOGRAM_WRITE,
+			/** Time hidapi_parser took to parse an Input report */
+			HID_HISTOGRAM_PARSE,
+
+			HID_HISTOGRAM_COUNT
+		};
+
+		/** A log-bucketed histogram of durations in nanoseconds.
+
+			Every power of two is split into 4 buckets, so a value is
+			counted within 25% of its size. Bucket i counts the values
+			from hid_histogram_bucket_start(i) up to
+			hid_histogram_bucket_start(i + 1).
+		*/
+		struct hid_histogram {
+			/** Number of recorded values */
+			uint64_t count;
+			uint64_t buckets[HID_HISTOGRAM_BUCKETS];
+		};
+
+		/** @brief Enable or disable the latency histograms of a device.
+
+			The histograms are off by default, since they need a few
+			kilobytes per device. Disabling them keeps the values
+			recorded so far.
+
+			@ingroup API
+			@param device A device handle returned from hid_open().
+			@param enable 1 to record the histograms, 0 to stop.
+
+			@returns
+				This function returns 0 on success and -1 on error.
+		*/
+		int HID_API_EXPORT HID_API_CALL hid_set_histograms(hid_device *device, int enable);
+
+		/** @brief Get a latency histogram of a device.
+
+			@ingroup API
+			@param device A device handle returned from hid_open().
+			@param type One of #hid_histogram_type.
+			@param histogram Set to the current histogram.
+
+			@returns
+				This function returns 0 on success and -1 on error,
+				or if the histograms were never enabled.
+		*/
+		int HID_API_EXPORT HID_API_CALL hid_get_histogram(hid_device *device, int type, struct hid_histogram *histogram);
+
+		/** @brief Get the lower bound of a histogram bucket.
+
+			@ingroup API
+			@param bucket The index of the bucket, from 0 to
+				#HID_HISTOGRAM_BUCKETS - 1.
+
+			@returns
+				The smallest value, in nanoseconds, which is counted
+				in the bucket.
+		*/
+		uint64_t HID_API_EXPORT HID_API_CALL hid_histogram_bucket_start(int bucket);
+
+		struct hid_reactor_;
+		typedef struct hid_reactor_ hid_reactor; /**< opaque reactor structure */
+
+		/** @brief Create a reactor which waits on many devices at once.
+
+			A reactor holds a single epoll set for any number of
+			devices, so one system call waits for all of them.
+			Only available in the hidraw implementation, elsewhere
+			the hid_reactor functions fail with errno set to
+			ENOTSUP.
+
+			@ingroup API
+
+			@returns
+				This function returns a pointer to a #hid_reactor object
+				on success or NULL on failure.
+		*/
+		HID_API_EXPORT hid_reactor * HID_API_CALL hid_reactor_new(void);
+
+		/** @brief Create a reactor which reads through io_uring.
+
+			Every device in the reactor always has a read queued in
+			the kernel, and hid_reactor_dispatch() collects all
+			finished reads with one system call. Such a reactor can
+			not be used with hid_reactor_wait().
+
+			If hidapi was built without io_uring support, or the
+			kernel does not provide it, this returns an ordinary
+			reactor from hid_reactor_new() instead.
+
+			@ingroup API
+
+			@returns
+				This function returns a pointer to a #hid_reactor object
+				on success or NULL on failure.
+		*/
+		HID_API_EXPORT hid_reactor * HID_API_CALL hid_reactor_new_io_uring(void);
+
+		/** @brief Free a reactor created by hid_reactor_new().
+
+			The devices in it are not closed.
+
+			@ingroup API
+			@param reactor A reactor returned from hid_reactor_new().
+		*/
+		void HID_API_EXPORT HID_API_CALL hid_reactor_free(hid_reactor *reactor);
+
+		/** @brief Add a device to a reactor.
+
+			A device must be removed again before it is closed.
+
+			@ingroup API
+			@param reactor A reactor returned from hid_reactor_new().
+			@param device A device handle returned from hid_open().
+
+			@returns
+				This function returns 0 on success and -1 on error.
+		*/
+		int HID_API_EXPORT HID_API_CALL hid_reactor_add(hid_reactor *reactor, hid_device *device);
+
+		/** @brief Remove a device from a reactor.
+
+			@ingroup API
+			@param reactor A reactor returned from hid_reactor_new().
+			@param device A device handle passed to hid_reactor_add().
+
+			@returns
+				This function returns 0 on success and -1 on error.
+		*/
+		int HID_API_EXPORT HID_API_CALL hid_reactor_remove(hid_reactor *reactor, hid_device *device);
+
+		/** @brief Wait until one or more devices in a reactor are ready.
+
+			Nothing is read; call hid_read_timeout() with a timeout of
+			0 on each of the returned devices. A device which has been
+			disconnected is returned as ready too, and reading from it
+			returns -1. Fails with EINVAL on a reactor from
+			hid_reactor_new_io_uring().
+
+			@ingroup API
+			@param reactor A reactor returned from hid_reactor_new().
+			@param ready An array to put the ready devices into.
+			@param max_ready The size of @p ready (at most 64 are
+				returned per call).
+			@param milliseconds timeout in milliseconds or -1 for blocking wait.
+
+			@returns
+				This function returns the number of ready devices, 0 on
+				timeout and -1 on error.
+		*/
+		int HID_API_EXPORT HID_API_CALL hid_reactor_wait(hid_reactor *reactor, hid_device **ready, int max_ready, int milliseconds);
+
+		/** @brief Wait for devices in a reactor, and read from the ready ones.
+
+			One report is read from every ready device and passed to
+			its input report callback (see
+			hid_set_input_report_callback()); a device without a
+			callback loses the report. A disconnected device is removed
+			from the reactor.
+
+			@ingroup API
+			@param reactor A reactor returned from hid_reactor_new().
+			@param milliseconds timeout in milliseconds or -1 for blocking wait.
+
+			@returns
+				This function returns the number of reports dispatched,
+				0 on timeout and -1 on error.
+		*/
+		int HID_API_EXPORT HID_API_CALL hid_reactor_dispatch(hid_reactor *reactor, int milliseconds);
+
+		/** Hotplug events, see hid_hotplug_register(). */
+		typedef enum {
+			HID_HOTPLUG_EVENT_DEVICE_ARRIVED = 1 << 0,
+			HID_HOTPLUG_EVENT_DEVICE_LEFT = 1 << 1,
+		} hid_hotplug_event;
+
+		/** Report the devices which are already connected when the
+		    callback is registered, see hid_hotplug_register(). */
+		#define HID_HOTPLUG_ENUMERATE (1 << 0)
+
+		/** Identifies a registered hotplug callback. */
+		typedef int hid_hotplug_handle;
+
+		/** Hotplug callback, see hid_hotplug_register(). @p device is
+		    a single record (its next pointer is NULL) and is only valid
+		    for the duration of the call. */
+		typedef void (*hid_hotplug_callback)(hid_hotplug_handle handle, struct hid_device_info *device, hid_hotplug_event event, void *user_data);
+
+		/** @brief Get notified when devices are connected or disconnected.
+
+			Nothing is called on its own. Wait for the descriptor from
+			hid_hotplug_get_fd() to become readable and then call
+			hid_hotplug_handle_events(), which calls the callbacks.
+			All hotplug functions must be called from the same thread.
+
+			On the hidraw implementation the events come from a udev
+			monitor, on the libusb implementation from libusb's
+			hotplug support.
+
+			@ingroup API
+			@param vendor_id The Vendor ID (VID) to match, or 0 for any.
+			@param product_id The Product ID (PID) to match, or 0 for any.
+			@param usage_page The Usage Page to match, or 0 for any.
+			@param usage The Usage to match, or 0 for any.
+			@param events A bitmask of #hid_hotplug_event values.
+			@param flags 0 or #HID_HOTPLUG_ENUMERATE.
+			@param callback The function to call for every event.
+			@param user_data Passed through to @p callback.
+			@param handle Set to the handle of the new callback (may
+				be NULL).
+
+			@returns
+				This function returns 0 on success and -1 on error.
+		*/
+		int HID_API_EXPORT HID_API_CALL hid_hotplug_register(unsigned short vendor_id, unsigned short product_id, unsigned short usage_page, unsigned short usage, int events, int flags, hid_hotplug_callback callback, void *user_data, hid_hotplug_handle *handle);
+
+		/** @brief Remove a hotplug callback.
+
+			May be called from within the callback.
+
+			@ingroup API
+			@param handle A handle set by hid_hotplug_register().
+
+			@returns
+				This function returns 0 on success and -1 on error.
+		*/
+		int HID_API_EXPORT HID_API_CALL hid_hotplug_deregister(hid_hotplug_handle handle);
+
+		/** @brief Get a descriptor which becomes readable on hotplug events.
+
+			@ingroup API
+
+			@returns
+				This function returns a file descriptor to poll() for
+				reading, or -1 if no callback is registered.
+		*/
+		int HID_API_EXPORT HID_API_CALL hid_hotplug_get_fd(void);
+
+		/** @brief Call the hotplug callbacks for all pending events.
+
+			Does not block.
+
+			@ingroup API
+
+			@returns
+				This function returns the number of events handled and
+				-1 on error.
+		*/
+		int HID_API_EXPORT HID_API_CALL hid_hotplug_handle_events(void);
+#endif
 
 #ifdef __cplusplus
 }
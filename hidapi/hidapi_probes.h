@@ -0,0 +1,45 @@
+/*******************************************************
+ HIDAPI - Multi-Platform library for
+ communication with HID devices.
+
+ Statically defined tracepoints (USDT) in the hot paths of the
+ Linux/FreeBSD backends and of hidapi_parser, for bpftrace, perf or
+ systemtap. They are built in with the HID_USDT cmake option, and are
+ single nop instructions until a tracer attaches to them. Without
+ HAVE_SYS_SDT_H they compile to nothing.
+
+ All probes are in the "hidapi" provider; the first argument is the
+ hid_device (or hid_dev_desc for the parser probes):
+
+   report_receive(dev, length, timestamp)
+   queue_enqueue(dev, depth)              (libusb only)
+   queue_dequeue(dev, depth, latency_ns)  (libusb only)
+   queue_drop(dev)                        (libusb only)
+   parse_start(devdesc, length)
+   parse_end(devdesc, duration_ns)         (duration_ns is 0 unless
+                                           hid_set_parse_timing() is on)
+   element_callback(devdesc, usage_page, usage, value)
+   write(dev, length, duration_ns)
+
+ e.g. bpftrace -e 'usdt:./hidtest:hidapi:parse_start { @s[tid] = nsecs; }
+   usdt:./hidtest:hidapi:parse_end /@s[tid]/ { @ = hist(nsecs - @s[tid]); delete(@s[tid]); }'
+********************************************************/
+
+#ifndef HIDAPI_PROBES_H__
+#define HIDAPI_PROBES_H__
+
+#ifdef HAVE_SYS_SDT_H
+#include <sys/sdt.h>
+
+#define HID_PROBE1(name, a) DTRACE_PROBE1(hidapi, name, a)
+#define HID_PROBE2(name, a, b) DTRACE_PROBE2(hidapi, name, a, b)
+#define HID_PROBE3(name, a, b, c) DTRACE_PROBE3(hidapi, name, a, b, c)
+#define HID_PROBE4(name, a, b, c, d) DTRACE_PROBE4(hidapi, name, a, b, c, d)
+#else
+#define HID_PROBE1(name, a) do {} while (0)
+#define HID_PROBE2(name, a, b) do {} while (0)
+#define HID_PROBE3(name, a, b, c) do {} while (0)
+#define HID_PROBE4(name, a, b, c, d) do {} while (0)
+#endif
+
+#endif
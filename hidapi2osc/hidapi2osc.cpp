@@ -43,10 +43,17 @@
 	#include <windows.h>
 #else
 	#include <unistd.h>
+	#include <fcntl.h>
+	#include <poll.h>
+	#include <pthread.h>
+	#include <stdint.h>
+	#include <arpa/inet.h>
+	#include <sys/socket.h>
 #endif
 
 
 #include <map>
+#include <vector>
 
 typedef std::map<int, hid_dev_desc* > hid_map_t;
 
@@ -57,13 +64,202 @@ int done = 0;
 
 #define MAX_STR 255
 
+#ifndef _WIN32
+// hiddevices is only used on the main thread, which reads from the
+// devices. The OSC handlers run on the liblo thread, so they queue
+// their requests here and wake the main loop through wakeup_pipe.
+enum device_request_type { REQUEST_OPEN, REQUEST_CLOSE, REQUEST_OUTPUT, REQUEST_ELEMENT_OUTPUT,
+			   REQUEST_INFO, REQUEST_ELEMENT_INFO };
+
+struct device_request {
+  device_request_type type;
+  int vendor;
+  int product;
+  int joy_idx;
+  int id;     // report id, or element index
+  int value;
+};
+
+std::vector<device_request> device_requests;
+pthread_mutex_t device_requests_mutex = PTHREAD_MUTEX_INITIALIZER;
+int wakeup_pipe[2] = { -1, -1 };
+
+void wake_main_loop(){
+  if ( write( wakeup_pipe[1], "", 1 ) < 0 && errno != EAGAIN ){
+    perror( "hidapi2osc: write to wakeup pipe" );
+  }
+}
+
+void queue_device_request( device_request_type type, int vendor, int product, int joy_idx, int id=0, int value=0 ){
+  device_request req = { type, vendor, product, joy_idx, id, value };
+  pthread_mutex_lock( &device_requests_mutex );
+  device_requests.push_back( req );
+  pthread_mutex_unlock( &device_requests_mutex );
+  wake_main_loop();
+}
+#endif
+
 
 lo_address t;
 lo_server s;
 lo_server_thread st;
 
+// The largest bundle sent, so it fits into one UDP datagram on Ethernet
+// (1500 bytes MTU minus the IP and UDP headers).
+#define OSC_MAX_BUNDLE_SIZE 1472
+
+// While parse_input_report() runs, the element changes of the report are
+// gathered here and sent as one bundle (or a few, if it gets too big).
+int collecting_elements = 0;
+lo_timetag element_timetag;
+lo_bundle element_bundle = NULL;
+
+#ifndef _WIN32
+// Element data is encoded by hand into a reusable bundle buffer and sent
+// with sendto() on the socket of the liblo server, without any allocation. Every /hid/element/data message
+// has the same size, so each slot of the buffer keeps its preencoded
+// size, address pattern and type tags; only the arguments are written.
+#define ELEMENT_MSG_SIZE 64   // "/hid/element/data" 20, ",iiiiiffi" 12, 8 arguments 32
+#define ELEMENT_SLOT_SIZE ( 4 + ELEMENT_MSG_SIZE )
+#define ELEMENT_ARGS_OFFSET ( 4 + 32 )
+#define ELEMENT_SLOTS ( ( OSC_MAX_BUNDLE_SIZE - 16 ) / ELEMENT_SLOT_SIZE )
+
+int element_socket = -1;   // the liblo server's, not owned
+struct sockaddr_storage element_addr;
+socklen_t element_addrlen = 0;
+unsigned char element_buf[ 16 + ELEMENT_SLOTS * ELEMENT_SLOT_SIZE ];
+int element_slots_used = 0;
+
+static void put_int32( unsigned char * p, uint32_t v )
+{
+  v = htonl( v );
+  memcpy( p, &v, 4 );
+}
+
+static void put_float( unsigned char * p, float f )
+{
+  uint32_t v;
+  memcpy( &v, &f, 4 );
+  put_int32( p, v );
+}
+
+// Set up the destination and the preencoded bundle buffer. The bundles go
+// out from the same socket (and source port) as the other messages. If
+// the address is not numeric, the element data goes through liblo.
+void open_element_socket( const char * ip, const char * port )
+{
+  int fd = lo_server_get_socket_fd( s );
+  struct sockaddr_storage local;
+  socklen_t locallen = sizeof(local);
+
+  memset( &element_addr, 0, sizeof(element_addr) );
+  if ( fd >= 0 && getsockname( fd, (struct sockaddr *) &local, &locallen ) == 0 ){
+    if ( local.ss_family == AF_INET ){
+      struct sockaddr_in * addr = (struct sockaddr_in *) &element_addr;
+      addr->sin_family = AF_INET;
+      addr->sin_port = htons( atoi( port ) );
+      if ( inet_pton( AF_INET, ip, &addr->sin_addr ) == 1 ){
+	element_addrlen = sizeof(struct sockaddr_in);
+      }
+    } else if ( local.ss_family == AF_INET6 ){
+      struct sockaddr_in6 * addr = (struct sockaddr_in6 *) &element_addr;
+      addr->sin6_family = AF_INET6;
+      addr->sin6_port = htons( atoi( port ) );
+      if ( inet_pton( AF_INET6, ip, &addr->sin6_addr ) == 1 ){
+	element_addrlen = sizeof(struct sockaddr_in6);
+      } else if ( inet_pton( AF_INET, ip, &addr->sin6_addr.s6_addr[12] ) == 1 ){
+	// an IPv4 address, mapped
+	addr->sin6_addr.s6_addr[10] = 0xff;
+	addr->sin6_addr.s6_addr[11] = 0xff;
+	element_addrlen = sizeof(struct sockaddr_in6);
+      }
+    }
+  }
+  if ( element_addrlen == 0 ){
+    fprintf( stderr, "hidapi2osc: %s is not a numeric address, sending element data through liblo\n", ip );
+    return;
+  }
+  element_socket = fd;
+
+  memcpy( element_buf, "#bundle", 8 );
+  for ( int i = 0; i < ELEMENT_SLOTS; i++ ){
+    unsigned char * slot = element_buf + 16 + i * ELEMENT_SLOT_SIZE;
+    put_int32( slot, ELEMENT_MSG_SIZE );
+    memcpy( slot + 4, "/hid/element/data\0\0\0,iiiiiffi\0\0", 32 );
+  }
+}
+
+static void send_element_slots()
+{
+  if ( element_slots_used == 0 )
+    return;
+  put_int32( element_buf + 8, element_timetag.sec );
+  put_int32( element_buf + 12, element_timetag.frac );
+  if ( sendto( element_socket, element_buf, 16 + element_slots_used * ELEMENT_SLOT_SIZE, 0,
+	       (struct sockaddr *) &element_addr, element_addrlen ) < 0 ){
+    perror( "hidapi2osc: sendto" );
+  }
+  element_slots_used = 0;
+}
+
+static void add_element_slot( struct hid_device_element *el, int devid )
+{
+  if ( element_slots_used == ELEMENT_SLOTS ){
+    send_element_slots();
+  }
+  unsigned char * args = element_buf + 16 + element_slots_used * ELEMENT_SLOT_SIZE + ELEMENT_ARGS_OFFSET;
+  put_int32( args, devid );
+  put_int32( args + 4, el->index );
+  put_int32( args + 8, el->usage_page );
+  put_int32( args + 12, el->usage );
+  put_int32( args + 16, el->value );
+  put_float( args + 20, hid_element_map_logical( el ) );
+  put_float( args + 24, hid_element_map_physical( el ) );
+  put_int32( args + 28, el->array_value );
+  element_slots_used++;
+}
+#endif
+
+static void send_element_bundle()
+{
+#ifndef _WIN32
+  if ( element_socket >= 0 ){
+    send_element_slots();
+    return;
+  }
+#endif
+  if ( element_bundle == NULL )
+    return;
+  if ( lo_send_bundle_from( t, s, element_bundle ) == -1 ){
+    printf("hid/element/data: OSC error %d: %s\n", lo_address_errno(t), lo_address_errstr(t));
+  }
+  lo_bundle_free_messages( element_bundle );
+  element_bundle = NULL;
+}
+
+static void add_element_message( lo_message m1 )
+{
+  const char * path = "/hid/element/data";
+  // a bundle element is the message size followed by the message
+  size_t size = 4 + lo_message_length( m1, path );
+
+  if ( element_bundle != NULL && lo_bundle_length( element_bundle ) + size > OSC_MAX_BUNDLE_SIZE ){
+    send_element_bundle();
+  }
+  if ( element_bundle == NULL ){
+    element_bundle = lo_bundle_new( element_timetag );
+  }
+  lo_bundle_add_message( element_bundle, path, m1 );
+}
+
 static void osc_element_cb( struct hid_device_element *el, void *data)
 {
+#ifndef _WIN32
+  if ( collecting_elements && element_socket >= 0 ){
+    add_element_slot( el, *((int*) data) );
+    return;
+  }
+#endif
   lo_message m1 = lo_message_new();
   lo_message_add_int32( m1, *((int*) data) );
   lo_message_add_int32( m1, el->index );
@@ -73,8 +269,23 @@ static void osc_element_cb( struct hid_device_element *el, void *data)
   lo_message_add_float( m1, hid_element_map_logical( el ) );
   lo_message_add_float( m1, hid_element_map_physical( el ) );
   lo_message_add_int32( m1, el->array_value );
-  lo_send_message_from( t, s, "/hid/element/data", m1 );
-  lo_message_free(m1);
+  if ( collecting_elements ){
+    add_element_message( m1 );
+  } else {
+    lo_send_message_from( t, s, "/hid/element/data", m1 );
+    lo_message_free(m1);
+  }
+}
+
+// Parse an input report, and send its element changes in one bundle
+// stamped with the time the report was read.
+void parse_input_report( unsigned char * buf, int size, struct hid_dev_desc * devdesc )
+{
+  lo_timetag_now( &element_timetag );
+  collecting_elements = 1;
+  hid_parse_input_report( buf, size, devdesc );
+  collecting_elements = 0;
+  send_element_bundle();
 }
 
 static void osc_descriptor_cb( struct hid_dev_desc *dd, void *data)
@@ -86,6 +297,11 @@ static void osc_descriptor_cb( struct hid_dev_desc *dd, void *data)
   lo_message_free(m1);
 }
 
+struct hid_dev_desc * find_device( int joy_idx ){
+  hid_map_t::const_iterator it = hiddevices.find( joy_idx );
+  return ( it == hiddevices.end() ) ? NULL : it->second;
+}
+
 void close_all_devices(){
   hid_map_t::const_iterator it;
   for(it=hiddevices.begin(); it!=hiddevices.end(); ++it){
@@ -125,8 +341,7 @@ void open_device( unsigned short vendor, unsigned short product, const wchar_t *
 }
 
 void close_device( int joy_idx ){
-//   hid_map_t::const_iterator it = ;
-  struct hid_dev_desc * hidtoclose = hiddevices.find( joy_idx )->second;
+  struct hid_dev_desc * hidtoclose = find_device( joy_idx );
   if ( hidtoclose == NULL ){    
     lo_send_from( t, s, LO_TT_IMMEDIATE, "/hid/close/error", "i", joy_idx );
   } else {
@@ -138,19 +353,21 @@ void close_device( int joy_idx ){
 
 
 void send_output_to_hid( int joy_idx, int reportid ){ 
-  struct hid_dev_desc * hidtosendoutput = hiddevices.find( joy_idx )->second;
-  hid_send_output_report( hidtosendoutput, reportid );
+  struct hid_dev_desc * hidtosendoutput = find_device( joy_idx );
+  if ( hidtosendoutput != NULL ){
+    hid_send_output_report( hidtosendoutput, reportid );
+  }
 }
 
 void set_element_output( int joy_idx, int elementid, int value ){ 
-  struct hid_dev_desc * devd = hiddevices.find( joy_idx )->second;
+  struct hid_dev_desc * devd = find_device( joy_idx );
   
   if ( devd != NULL ){
     // find the right output element
     struct hid_device_collection * device_collection = devd->device_collection;
     struct hid_device_element * cur_element = device_collection->first_element;
     
-    while ( (cur_element->io_type != 2 || (cur_element->index != elementid)) && cur_element != NULL ){
+    while ( cur_element != NULL && (cur_element->io_type != 2 || (cur_element->index != elementid)) ){
 	cur_element = hid_get_next_output_element(cur_element);
     }
     if ( cur_element != NULL ){
@@ -195,7 +412,7 @@ int init_osc( char * ip, char *outport, char * port ){
      /* create liblo addres */
     t = lo_address_new(ip, outport); // change later to use other host
 
-    lo_server_thread st = lo_server_thread_new(port, error);
+    st = lo_server_thread_new(port, error);
 
     lo_server_thread_add_method(st, "/hid/open", "ii", hid_open_handler, NULL);
     lo_server_thread_add_method(st, "/hid/element/info", "i", hid_element_info_handler, NULL);
@@ -211,9 +428,10 @@ int init_osc( char * ip, char *outport, char * port ){
 
     lo_server_thread_start(st);
  
-    lo_server s = lo_server_thread_get_server( st );
+    s = lo_server_thread_get_server( st );
 
     lo_send_from( t, s, LO_TT_IMMEDIATE, "/hidapi2osc/started", "" ); 
+    return 0;
 }
 
 lo_message get_hid_info_msg( struct hid_device_info * info )
@@ -314,6 +532,17 @@ int generic_handler(const char *path, const char *types, lo_arg **argv,
     return 1;
 }
 
+// hid_enumerate lists a device once per top-level collection, with the same
+// path; /hid/info carries no usage, so only the first of those is sent
+struct hid_device_info * next_hid_node( struct hid_device_info * info )
+{
+  struct hid_device_info * next = info->next;
+  while ( next != NULL && strcmp( next->path, info->path ) == 0 ){
+    next = next->next;
+  }
+  return next;
+}
+
 int info_handler(const char *path, const char *types, lo_arg **argv, int argc,
 		 void *data, void *user_data)
 {  
@@ -324,7 +553,7 @@ int info_handler(const char *path, const char *types, lo_arg **argv, int argc,
   int count = 0;
   while (cur_dev) {
     count++;
-    cur_dev = cur_dev->next;
+    cur_dev = next_hid_node( cur_dev );
   }
  
   lo_bundle b = lo_bundle_new( LO_TT_IMMEDIATE );
@@ -337,7 +566,7 @@ int info_handler(const char *path, const char *types, lo_arg **argv, int argc,
   while (cur_dev) {
     lo_message m2 = get_hid_info_msg( cur_dev );
     lo_bundle_add_message( b, "/hid/info", m2 );
-    cur_dev = cur_dev->next;
+    cur_dev = next_hid_node( cur_dev );
   }
 
   if ( lo_send_bundle_from( t, s, b )  == -1 ){
@@ -354,6 +583,9 @@ int quit_handler(const char *path, const char *types, lo_arg **argv, int argc,
 		 void *data, void *user_data)
 {
     done = 1;
+#ifndef _WIN32
+    wake_main_loop();
+#endif
     printf("hidapi2osc: allright, that's it, I quit\n");
     fflush(stdout);
 
@@ -362,7 +594,7 @@ int quit_handler(const char *path, const char *types, lo_arg **argv, int argc,
 
 void send_elements_hid_info(int joy_idx)
 {
-  hid_dev_desc * hid = hiddevices.find( joy_idx )->second;
+  hid_dev_desc * hid = find_device( joy_idx );
   if ( hid == NULL ){
       lo_send_from( t, s, LO_TT_IMMEDIATE, "/hid/element/info/error", "i", joy_idx );
       return;
@@ -390,7 +622,7 @@ void send_elements_hid_info(int joy_idx)
 
 void send_hid_info(int joy_idx)
 {
-  hid_dev_desc * hid = hiddevices.find( joy_idx )->second;
+  hid_dev_desc * hid = find_device( joy_idx );
   if ( hid != NULL ){
     lo_message m1 = get_hid_info_msg( hid->info );   
     lo_send_message_from( t, s, "/hid/info", m1 );
@@ -405,7 +637,11 @@ int hid_info_handler(const char *path, const char *types, lo_arg **argv, int arg
 {
   printf("hidapi2osc: joystick info handler\n");
 
+#ifdef _WIN32
   send_hid_info( argv[0]->i );
+#else
+  queue_device_request( REQUEST_INFO, 0, 0, argv[0]->i );
+#endif
   return 0;
 }
 
@@ -414,7 +650,11 @@ int hid_element_info_handler(const char *path, const char *types, lo_arg **argv,
 {
   printf("hidapi2osc: joystick elements info handler\n");
 
+#ifdef _WIN32
   send_elements_hid_info( argv[0]->i );
+#else
+  queue_device_request( REQUEST_ELEMENT_INFO, 0, 0, argv[0]->i );
+#endif
   return 0;
 }
 
@@ -422,7 +662,11 @@ int hid_element_output_handler(const char *path, const char *types, lo_arg **arg
 		 void *data, void *user_data)
 {
   printf("hidapi2osc: joystick elements output handler\n");
+#ifdef _WIN32
   set_element_output( argv[0]->i, argv[1]->i, argv[2]->i );
+#else
+  queue_device_request( REQUEST_ELEMENT_OUTPUT, 0, 0, argv[0]->i, argv[1]->i, argv[2]->i );
+#endif
   return 0;
 }
 
@@ -430,7 +674,11 @@ int hid_output_handler(const char *path, const char *types, lo_arg **argv, int a
 		 void *data, void *user_data)
 {
   printf("hidapi2osc: joystick output handler\n");
+#ifdef _WIN32
   send_output_to_hid( argv[0]->i, argv[1]->i );
+#else
+  queue_device_request( REQUEST_OUTPUT, 0, 0, argv[0]->i, argv[1]->i );
+#endif
   return 0;
 }
 
@@ -438,7 +686,11 @@ int hid_open_handler(const char *path, const char *types, lo_arg **argv, int arg
 		 void *data, void *user_data)
 {
 //   printf("hidapi2osc: joystick open handler\n");
+#ifdef _WIN32
   open_device( argv[0]->i, argv[1]->i, NULL );
+#else
+  queue_device_request( REQUEST_OPEN, argv[0]->i, argv[1]->i, 0 );
+#endif
   return 0;
 }
 
@@ -446,7 +698,11 @@ int hid_close_handler(const char *path, const char *types, lo_arg **argv, int ar
 		 void *data, void *user_data)
 {
   printf("hidapi2osc: joystick close handler, %i\n", argv[0]->i );
+#ifdef _WIN32
   close_device( argv[0]->i );
+#else
+  queue_device_request( REQUEST_CLOSE, 0, 0, argv[0]->i );
+#endif
   return 0;
 }
 
@@ -454,6 +710,94 @@ int hid_close_handler(const char *path, const char *types, lo_arg **argv, int ar
  
 /// end OSC stuff
 
+#ifndef _WIN32
+// Carry out the requests queued by the OSC handlers.
+void handle_device_requests(){
+  std::vector<device_request> requests;
+  char drain[64];
+
+  while ( read( wakeup_pipe[0], drain, sizeof(drain) ) > 0 )
+    ;
+
+  pthread_mutex_lock( &device_requests_mutex );
+  requests.swap( device_requests );
+  pthread_mutex_unlock( &device_requests_mutex );
+
+  for ( size_t i = 0; i < requests.size(); i++ ){
+    const device_request & req = requests[i];
+    switch ( req.type ){
+    case REQUEST_OPEN:
+      open_device( req.vendor, req.product, NULL );
+      break;
+    case REQUEST_CLOSE:
+      close_device( req.joy_idx );
+      break;
+    case REQUEST_OUTPUT:
+      send_output_to_hid( req.joy_idx, req.id );
+      break;
+    case REQUEST_ELEMENT_OUTPUT:
+      set_element_output( req.joy_idx, req.id, req.value );
+      break;
+    case REQUEST_INFO:
+      send_hid_info( req.joy_idx );
+      break;
+    case REQUEST_ELEMENT_INFO:
+      send_elements_hid_info( req.joy_idx );
+      break;
+    }
+  }
+}
+
+// Wait until a device has input or a request comes in, then read all
+// reports queued on the ready devices. Idle while nothing happens.
+void hid_poll_loop(){
+  std::vector<struct pollfd> fds;
+  std::vector<int> indices;
+  unsigned char buf[256];
+
+  while ( !done ){
+    fds.clear();
+    indices.clear();
+
+    struct pollfd wakeup = { wakeup_pipe[0], POLLIN, 0 };
+    fds.push_back( wakeup );
+    hid_map_t::const_iterator it;
+    for ( it=hiddevices.begin(); it!=hiddevices.end(); ++it ){
+      struct pollfd pfd = { (int) (intptr_t) hid_get_event_handle( it->second->device ), POLLIN, 0 };
+      fds.push_back( pfd );
+      indices.push_back( it->first );
+    }
+
+    if ( poll( &fds[0], fds.size(), -1 ) < 0 ){
+      if ( errno == EINTR )
+	continue;
+      perror( "hidapi2osc: poll" );
+      break;
+    }
+
+    for ( size_t i = 1; i < fds.size(); i++ ){
+      if ( !fds[i].revents )
+	continue;
+      struct hid_dev_desc * devdesc = find_device( indices[i-1] );
+      if ( devdesc == NULL )
+	continue;
+      int res;
+      while ( (res = hid_read( devdesc->device, buf, sizeof(buf) )) > 0 ){
+	parse_input_report( buf, res, devdesc );
+      }
+      if ( res < 0 ){
+	// the device is gone
+	close_device( indices[i-1] );
+      }
+    }
+
+    if ( fds[0].revents ){
+      handle_device_requests();
+    }
+  }
+}
+#endif
+
 
 int str2int(const char* str, int* val)
 {
@@ -609,13 +953,26 @@ int main(int argc, char** argv)
 	outport = argv[2];
 	}
   
+#ifndef _WIN32
+      if ( pipe( wakeup_pipe ) < 0 ){
+	perror( "hidapi2osc: pipe" );
+	return -1;
+      }
+      fcntl( wakeup_pipe[0], F_SETFL, O_NONBLOCK );
+      fcntl( wakeup_pipe[1], F_SETFL, O_NONBLOCK );
+#endif
+
       init_osc( ip, outport, port );
+#ifndef _WIN32
+      open_element_socket( ip, outport );
+#endif
 
       if (hid_init())
 	return -1;
     
       printf("Entering hid read loop, press Ctrl-c to exit\n");
 
+#ifdef _WIN32
       int res = 0;
       hid_map_t::const_iterator it;
       unsigned char buf[256];
@@ -623,15 +980,14 @@ int main(int argc, char** argv)
 	for(it=hiddevices.begin(); it!=hiddevices.end(); ++it){
 	  res = hid_read( it->second->device, buf, sizeof(buf));
 	  if ( res > 0 ) {
-	    hid_parse_input_report( buf, res, it->second );
+	    parse_input_report( buf, res, it->second );
 	  }
 	}
-	#ifdef WIN32
 	Sleep(50);
-	#else
-	usleep(500*10);
-	#endif
       }
+#else
+      hid_poll_loop();
+#endif
       close_all_devices();
 	  
       lo_send_from( t, s, LO_TT_IMMEDIATE, "/hidapi2osc/quit", "s", "nothing more to do, quitting" );
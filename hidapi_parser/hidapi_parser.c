@@ -35,6 +35,11 @@
 #include <hidsdi.h>
 #endif
 
+#ifdef LINUX_FREEBSD
+#include <time.h>
+#include "hidapi_probes.h"
+#endif
+
 #include "hidapi_parser.h"
 
 
@@ -171,6 +176,7 @@ struct hid_device_element * hid_new_element(){
   element->unit_exponent = 0;
 
   element->rawvalue = 0;
+  element->timestamp = 0;
 
   return element;
 }
@@ -899,6 +905,39 @@ int hid_parse_input_report( unsigned char* buf, int size, struct hid_dev_desc *
   return hid_parse_input_elements_values( buf, size, devdesc );
 #endif
 #ifdef LINUX_FREEBSD
+  return hid_parse_input_report_timestamped( buf, size, devdesc, 0 );
+#endif
+}
+
+#ifdef LINUX_FREEBSD
+static int hid_parse_input_report_values( unsigned char* buf, int size, struct hid_dev_desc * devdesc, uint64_t timestamp );
+
+int hid_parse_input_report_timestamped( unsigned char* buf, int size, struct hid_dev_desc * devdesc, uint64_t timestamp ){
+  struct timespec start, end;
+  uint64_t duration;
+  int res;
+
+  // the clock is only read for hid_get_stats and the histograms; a tracer
+  // times parse_start to parse_end itself, the duration is 0 then
+  if ( devdesc->device == NULL || !hid_get_parse_timing( devdesc->device ) ){
+    HID_PROBE2( parse_start, devdesc, size );
+    res = hid_parse_input_report_values( buf, size, devdesc, timestamp );
+    HID_PROBE2( parse_end, devdesc, 0 );
+    return res;
+  }
+
+  HID_PROBE2( parse_start, devdesc, size );
+  clock_gettime( CLOCK_MONOTONIC, &start );
+  res = hid_parse_input_report_values( buf, size, devdesc, timestamp );
+  clock_gettime( CLOCK_MONOTONIC, &end );
+  duration = (uint64_t) (end.tv_sec - start.tv_sec) * 1000000000 + end.tv_nsec - start.tv_nsec;
+  HID_PROBE2( parse_end, devdesc, duration );
+
+  hid_stats_add_parse_time( devdesc->device, duration );
+  return res;
+}
+
+static int hid_parse_input_report_values( unsigned char* buf, int size, struct hid_dev_desc * devdesc, uint64_t timestamp ){
   struct hid_parsing_byte pbyte;
   pbyte.nextVal = 0;
   pbyte.currentSize = 10;
@@ -921,12 +960,16 @@ int hid_parse_input_report( unsigned char* buf, int size, struct hid_dev_desc *
   if ( cur_element->io_type != 1 || ( cur_element->report_id != reportid ) ){
       cur_element = hid_get_next_input_element_with_reportid(cur_element, reportid );
   }
+  // a report id we have no input elements for, e.g. when parsing straight from the receive buffer
+  if ( cur_element == NULL ){
+      return -1;
+  }
 
   for ( i = starti; i < size; i++){
     unsigned char curbyte = buf[i];
     pbyte.remainingBits = 8;
     pbyte.shiftedByte = curbyte;
-    while( pbyte.remainingBits > 0 ) {
+    while( pbyte.remainingBits > 0 && cur_element != NULL ) {
       // get next element
       pbyte.currentSize = cur_element->report_size;
       newvalue = hid_parse_single_byte( pbyte.shiftedByte, &pbyte );
@@ -934,6 +977,8 @@ int hid_parse_input_report( unsigned char* buf, int size, struct hid_dev_desc *
 	if ( devdesc->_element_callback != NULL ){
 	  if ( newvalue != cur_element->rawvalue || cur_element->repeat ){
 	    hid_element_set_value_from_input( cur_element, newvalue );
+	    cur_element->timestamp = timestamp;
+	    HID_PROBE4( element_callback, devdesc, cur_element->usage_page, cur_element->usage, cur_element->value );
 	    devdesc->_element_callback( cur_element, devdesc->_element_data );
 	  }
 	}
@@ -942,9 +987,17 @@ int hid_parse_input_report( unsigned char* buf, int size, struct hid_dev_desc *
     }
   }
   return 0;
-#endif
 }
 
+static void hid_parse_received_report( hid_device *dev, unsigned char *data, size_t length, uint64_t timestamp, void *user_data ){
+  hid_parse_input_report_timestamped( data, (int) length, (struct hid_dev_desc *) user_data, timestamp );
+}
+
+int hid_parse_input_reports_on_receive( struct hid_dev_desc * devdesc, int keep_raw_reports ){
+  return hid_set_input_report_callback( devdesc->device, hid_parse_received_report, devdesc, keep_raw_reports );
+}
+#endif
+
 void hid_throw_readerror( struct hid_dev_desc * devd ){
   devd->_readerror_callback( devd, devd->_readerror_data );
 }
@@ -26,6 +26,8 @@
 #define HIDAPI_PARSER_H__
 
 
+#include <stdint.h>
+
 #define HIDAPI_MAX_DESCRIPTOR_SIZE  4096
 
 #ifdef __cplusplus /* If this is a C++ compiler, use C linkage */
@@ -98,6 +100,9 @@ struct hid_device_element {
 
 	int repeat;
 
+	/** CLOCK_MONOTONIC time (ns) of the report which last changed the value, 0 if unknown */
+	uint64_t timestamp;
+
 	/** Pointer to the next element */
 	struct hid_device_element *next;
 	
@@ -161,6 +166,15 @@ struct hid_device_element * hid_get_next_feature_element( struct hid_device_elem
 
 int hid_parse_input_report( unsigned char* buf, int size, struct hid_dev_desc * devdesc );
 
+#ifdef LINUX_FREEBSD
+/** same as hid_parse_input_report, with the receive time of the report (see hid_read_timestamped) for the elements' timestamp */
+int hid_parse_input_report_timestamped( unsigned char* buf, int size, struct hid_dev_desc * devdesc, uint64_t timestamp );
+
+/** parse every input report right where the backend received it (see hid_set_input_report_callback),
+ *  instead of reading it with hid_read first; keep_raw_reports also queues the raw reports for hid_read */
+int hid_parse_input_reports_on_receive( struct hid_dev_desc * devdesc, int keep_raw_reports );
+#endif
+
 float hid_element_resolution( struct hid_device_element * element );
 float hid_element_map_logical( struct hid_device_element * element );
 float hid_element_map_physical( struct hid_device_element * element );
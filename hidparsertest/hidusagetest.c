@@ -0,0 +1,105 @@
+/* hidusagetest
+ *
+ * Checks how the hidraw implementation finds the top-level collections of
+ * a report descriptor, which hid_enumerate() turns into one record each.
+ * get_hid_usages() is static, so linux/hid.c is compiled in here.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ */
+
+#include "../linux/hid.c"
+
+static int failures = 0;
+
+static void check_usages( const char *name, __u8 *descriptor, __u32 size, int max,
+                          int expected_count, const unsigned short *expected_pages, const unsigned short *expected_usages )
+{
+  unsigned short usage_pages[MAX_TOP_LEVEL_USAGES];
+  unsigned short usages[MAX_TOP_LEVEL_USAGES];
+  int count, i;
+
+  count = get_hid_usages( descriptor, size, usage_pages, usages, max );
+  if ( count != expected_count ){
+    printf( "FAIL %s: %i collections, expected %i\n", name, count, expected_count );
+    failures++;
+    return;
+  }
+  for ( i = 0; i < count; i++ ){
+    if ( usage_pages[i] != expected_pages[i] || usages[i] != expected_usages[i] ){
+      printf( "FAIL %s: collection %i is 0x%04hx/0x%04hx, expected 0x%04hx/0x%04hx\n", name, i,
+              usage_pages[i], usages[i], expected_pages[i], expected_usages[i] );
+      failures++;
+      return;
+    }
+  }
+  printf( "ok %s\n", name );
+}
+
+int main( void ){
+  /* Mouse, keyboard and consumer control in one descriptor, the
+     collections nested in the mouse don't count. */
+  __u8 multiple[] = {
+    0x05, 0x01,       /* Usage Page (Generic Desktop) */
+    0x09, 0x02,       /* Usage (Mouse) */
+    0xa1, 0x01,       /* Collection (Application) */
+    0x09, 0x01,       /*   Usage (Pointer) */
+    0xa1, 0x00,       /*   Collection (Physical) */
+    0x09, 0x30,       /*     Usage (X) */
+    0x81, 0x02,       /*     Input (Data,Var,Abs) */
+    0xc0,             /*   End Collection */
+    0xc0,             /* End Collection */
+    0x09, 0x06,       /* Usage (Keyboard) */
+    0xa1, 0x01,       /* Collection (Application) */
+    0x81, 0x02,       /*   Input (Data,Var,Abs) */
+    0xc0,             /* End Collection */
+    0x05, 0x0c,       /* Usage Page (Consumer) */
+    0x09, 0x01,       /* Usage (Consumer Control) */
+    0xa1, 0x01,       /* Collection (Application) */
+    0x81, 0x02,       /*   Input (Data,Var,Abs) */
+    0xc0,             /* End Collection */
+  };
+  unsigned short multiple_pages[] = { 0x01, 0x01, 0x0c };
+  unsigned short multiple_usages[] = { 0x02, 0x06, 0x01 };
+
+  /* A 4 byte Usage carries its own Usage Page, which wins over the
+     global one. */
+  __u8 extended[] = {
+    0x05, 0x01,                   /* Usage Page (Generic Desktop) */
+    0x0b, 0x01, 0x00, 0x0c, 0x00, /* Usage (Consumer:Consumer Control) */
+    0xa1, 0x01,                   /* Collection (Application) */
+    0xc0,                         /* End Collection */
+    0x09, 0x05,                   /* Usage (Game Pad) */
+    0xa1, 0x01,                   /* Collection (Application) */
+    0xc0,                         /* End Collection */
+  };
+  unsigned short extended_pages[] = { 0x0c, 0x01 };
+  unsigned short extended_usages[] = { 0x01, 0x05 };
+
+  /* Cut off inside the data of the second Collection item. */
+  __u8 truncated[] = {
+    0x05, 0x01,       /* Usage Page (Generic Desktop) */
+    0x09, 0x04,       /* Usage (Joystick) */
+    0xa1, 0x01,       /* Collection (Application) */
+    0xc0,             /* End Collection */
+    0x09, 0x05,       /* Usage (Game Pad) */
+    0xa2, 0x01,       /* Collection (Application), 2 byte data */
+  };
+  unsigned short truncated_pages[] = { 0x01 };
+  unsigned short truncated_usages[] = { 0x04 };
+
+  check_usages( "multiple collections", multiple, sizeof(multiple), MAX_TOP_LEVEL_USAGES,
+                3, multiple_pages, multiple_usages );
+  check_usages( "at most max collections", multiple, sizeof(multiple), 2,
+                2, multiple_pages, multiple_usages );
+  check_usages( "extended usage", extended, sizeof(extended), MAX_TOP_LEVEL_USAGES,
+                2, extended_pages, extended_usages );
+  check_usages( "truncated descriptor", truncated, sizeof(truncated), MAX_TOP_LEVEL_USAGES,
+                1, truncated_pages, truncated_usages );
+  check_usages( "empty descriptor", truncated, 0, MAX_TOP_LEVEL_USAGES,
+                0, truncated_pages, truncated_usages );
+
+  return failures ? 1 : 0;
+}
@@ -200,6 +200,30 @@ struct hid_device_descriptor *descriptor;
 
 #define BITMASK1(n) ((1ULL << (n)) - 1ULL)
 
+#ifdef LINUX_FREEBSD
+// Print the non-empty buckets of the latency histograms of a device.
+static void print_histograms(hid_device *handle)
+{
+	static const char *names[HID_HISTOGRAM_COUNT] = {
+		"report interval", "queue latency", "hid_write", "parse"
+	};
+	struct hid_histogram hist;
+
+	for (int type = 0; type < HID_HISTOGRAM_COUNT; type++) {
+		if (hid_get_histogram(handle, type, &hist) < 0 || hist.count == 0)
+			continue;
+		printf("%s (%llu values):\n", names[type], (unsigned long long) hist.count);
+		for (int i = 0; i < HID_HISTOGRAM_BUCKETS; i++) {
+			if (hist.buckets[i] == 0)
+				continue;
+			printf("  >= %10llu ns: %llu\n",
+				(unsigned long long) hid_histogram_bucket_start(i),
+				(unsigned long long) hist.buckets[i]);
+		}
+	}
+}
+#endif
+
 int main(int argc, char* argv[])
 {
 	int res;
@@ -259,6 +283,10 @@ int main(int argc, char* argv[])
  		return 1;
 	}
 
+#ifdef LINUX_FREEBSD
+	hid_set_histograms(handle, 1);
+#endif
+
 	// Read the Manufacturer String
 	wstr[0] = 0x0000;
 	res = hid_get_manufacturer_string(handle, wstr, MAX_STR);
@@ -667,6 +695,9 @@ int main(int argc, char* argv[])
 	}
 */
 
+#ifdef LINUX_FREEBSD
+	print_histograms(handle);
+#endif
 	hid_close(handle);
 
 	/* Free static HIDAPI objects. */
@@ -41,7 +41,11 @@
 #include <sys/utsname.h>
 #include <fcntl.h>
 #include <pthread.h>
+#include <sched.h>
 #include <wchar.h>
+#ifdef __linux__
+#include <sys/eventfd.h>
+#endif
 
 /* GNU / LibUSB */
 #include <libusb.h>
@@ -50,67 +54,7 @@
 #endif
 
 #include "hidapi.h"
-
-#ifdef __ANDROID__
-
-/* Barrier implementation because Android/Bionic don't have pthread_barrier.
-   This implementation came from Brent Priddy and was posted on
-   StackOverflow. It is used with his permission. */
-typedef int pthread_barrierattr_t;
-typedef struct pthread_barrier {
-    pthread_mutex_t mutex;
-    pthread_cond_t cond;
-    int count;
-    int trip_count;
-} pthread_barrier_t;
-
-static int pthread_barrier_init(pthread_barrier_t *barrier, const pthread_barrierattr_t *attr, unsigned int count)
-{
-	if(count == 0) {
-		errno = EINVAL;
-		return -1;
-	}
-
-	if(pthread_mutex_init(&barrier->mutex, 0) < 0) {
-		return -1;
-	}
-	if(pthread_cond_init(&barrier->cond, 0) < 0) {
-		pthread_mutex_destroy(&barrier->mutex);
-		return -1;
-	}
-	barrier->trip_count = count;
-	barrier->count = 0;
-
-	return 0;
-}
-
-static int pthread_barrier_destroy(pthread_barrier_t *barrier)
-{
-	pthread_cond_destroy(&barrier->cond);
-	pthread_mutex_destroy(&barrier->mutex);
-	return 0;
-}
-
-static int pthread_barrier_wait(pthread_barrier_t *barrier)
-{
-	pthread_mutex_lock(&barrier->mutex);
-	++(barrier->count);
-	if(barrier->count >= barrier->trip_count)
-	{
-		barrier->count = 0;
-		pthread_cond_broadcast(&barrier->cond);
-		pthread_mutex_unlock(&barrier->mutex);
-		return 1;
-	}
-	else
-	{
-		pthread_cond_wait(&barrier->cond, &(barrier->mutex));
-		pthread_mutex_unlock(&barrier->mutex);
-		return 0;
-	}
-}
-
-#endif
+#include "hidapi_probes.h"
 
 #ifdef __cplusplus
 extern "C" {
@@ -136,14 +80,41 @@ libusb HIDAPI programs are encouraged to use the interface number
 instead to differentiate between interfaces on a composite HID device. */
 /*#define INVASIVE_GET_USAGE*/
 
-#define MAX_QUEUE_LEN 30
-/* Linked List of input reports received from the device. */
+/* Default size of the input report ring, must be a power of 2 */
+#define MAX_QUEUE_LEN 32
+/* Upper limit of hid_set_input_queue() */
+#define MAX_QUEUE_CAPACITY 1024
+/* Upper limit of hid_set_input_transfers() */
+#define MAX_INPUT_TRANSFERS 32
+/* Writes in flight per device, see hid_write_async() */
+#define MAX_WRITE_TRANSFERS 8
+/* A slot in the ring of input reports received from the device. */
 struct input_report {
-	struct input_report *next;
+	uint64_t timestamp; /* CLOCK_MONOTONIC ns, see read_callback() */
 	size_t len;
-	uint8_t data[1];
+	uint8_t *data; /* input_ep_max_packet_size bytes of report_data */
+};
+
+
+/* An Output report waiting for writer_thread(), see hid_write_latest(). */
+struct pending_report {
+	struct pending_report *next;
+	size_t length;
+	size_t size; /* of data */
+	unsigned char *data;
 };
 
+/* An Output transfer of hid_write_async(). */
+struct write_transfer {
+	hid_device *dev;
+	struct libusb_transfer *transfer; /* allocated on first use */
+	size_t buffer_size;
+	size_t length; /* as passed to hid_write_async() */
+	int skipped_report_id;
+	uint64_t start; /* CLOCK_MONOTONIC ns when submitted */
+	hid_write_callback callback;
+	void *user_data;
+};
 
 struct hid_device_ {
 	/* Handle to the actual device. */
@@ -165,43 +136,210 @@ struct hid_device_ {
 	/* Whether blocking reads are used */
 	int blocking; /* boolean */
 
-	/* Read thread objects */
-	pthread_t thread;
-	pthread_mutex_t mutex; /* Protects input_reports */
+	/* Input report callback, see hid_set_input_report_callback() */
+	hid_input_report_callback input_callback;
+	void *input_callback_data;
+	int queue_reports; /* boolean */
+	int delivering; /* boolean, set while read_callback() hands a report on */
+
+	/* Input transfer objects, serviced by event_thread() */
+	pthread_mutex_t mutex; /* For the blocking waits on the ring, and
+	                          the ring itself with queue_locked() */
 	pthread_cond_t condition;
-	pthread_barrier_t barrier; /* Ensures correct startup sequence */
+	int num_waiting; /* threads waiting on condition */
 	int shutdown_thread;
-	int cancelled;
-	struct libusb_transfer *transfer;
-
-	/* List of received input reports. */
-	int num_queued_reports;
+	int cancelled; /* set once none of the transfers is submitted */
+	struct libusb_transfer *transfers[MAX_INPUT_TRANSFERS];
+	int num_transfers;
+	int num_active_transfers;
+
+	/* Ring of received input reports, filled by read_callback() only.
+	   Slots from tail to head are queued; both only ever increase and
+	   are used modulo queue_capacity. tail is advanced with a CAS, since
+	   read_callback() drops the oldest report when the ring is full. */
 	struct input_report *input_reports;
-        struct input_report **last_input_report;
-        int ichan[2];     /* thread write on 1 client poll on 0 */
-    
+	uint8_t *report_data;
+	unsigned int queue_capacity; /* a power of 2 */
+	unsigned int head;
+	unsigned int tail;
+
+	/* See hid_set_input_queue() */
+	enum hid_queue_policy queue_policy;
+	hid_queue_overflow_callback overflow_callback;
+	void *overflow_callback_data;
+	int queue_paused; /* boolean, read_callback() drops reports while set */
+	int uses_report_ids; /* boolean, from the report descriptor */
+	/* Completed transfers held back by HID_QUEUE_BLOCK until there is
+	   room in the ring, oldest first. Protected by mutex. */
+	struct libusb_transfer *parked[MAX_INPUT_TRANSFERS];
+	uint64_t parked_timestamps[MAX_INPUT_TRANSFERS];
+	int num_parked;
+	/* Readable while there are reports in the ring, see
+	   signal_events(). An eventfd (ichan[0] == ichan[1]) on Linux, a
+	   pipe elsewhere. */
+	int ichan[2];     /* thread write on 1 client poll on 0 */
+	int signalled;    /* whether ichan is readable */
+
+	/* Output transfers, bit i of writes_busy is set while writes[i]
+	   is submitted. write_callbacks counts the completion callbacks
+	   still running after their slot was freed. */
+	struct write_transfer writes[MAX_WRITE_TRANSFERS];
+	unsigned int writes_busy;
+	int write_callbacks;
+
+	/* See hid_get_stats() */
+	struct hid_device_stats stats;
+	int parse_timing; /* see hid_set_parse_timing() */
+
+	/* See hid_set_histograms(), NULL until they are first enabled */
+	struct hid_histogram *histograms;
+	int histograms_enabled;
+	uint64_t last_report; /* timestamp of the previous Input report */
+
+	/* Writer thread, see hid_write_latest() */
+	pthread_t writer;
+	pthread_mutex_t writer_mutex; /* Protects the fields below */
+	pthread_cond_t writer_condition;
+	int writer_started;
+	int writer_shutdown;
+	struct pending_report *pending_reports; /* at most one per report ID */
+	struct pending_report *free_reports;
 };
 
 static libusb_context *usb_context = NULL;
 
+/* Interrupt transfers kept submitted per device, see
+   hid_set_input_transfers() */
+static int num_input_transfers = 4;
+
+/* The one thread which handles the libusb events, for the transfers of
+   all open devices and for hotplug. It runs while users > 0. */
+static struct {
+	pthread_mutex_t mutex; /* Protects users */
+	int users;
+	int shutdown_thread;
+	pthread_t thread;
+} events = { .mutex = PTHREAD_MUTEX_INITIALIZER };
+
+/* A hotplug event queued by hotplug_libusb_callback(). */
+struct hotplug_event {
+	libusb_device *device; /* referenced */
+	libusb_hotplug_event event;
+	struct hotplug_event *next;
+};
+
+/* A connected HID interface, see hid_hotplug_register(). */
+struct hotplug_device {
+	libusb_device *device; /* referenced */
+	struct hid_device_info *info; /* a single record */
+	struct hotplug_device *next;
+};
+
+/* A registered hotplug callback. */
+struct hotplug_callback {
+	hid_hotplug_handle handle;
+	unsigned short vendor_id;
+	unsigned short product_id;
+	unsigned short usage_page;
+	unsigned short usage;
+	int events;
+	hid_hotplug_callback callback;
+	void *user_data;
+	int removed; /* deregistered while the callbacks were running */
+	struct hotplug_callback *next;
+};
+
+/* Hotplug state. Apart from the event queue, it is only used from the
+   thread calling the hotplug functions. */
+static struct {
+	pthread_mutex_t mutex; /* Protects events */
+	struct hotplug_event *events;
+	struct hotplug_event **last_event;
+	int pipe[2]; /* one byte per queued event */
+
+	int started; /* boolean */
+	libusb_hotplug_callback_handle libusb_handle;
+
+	struct hotplug_callback *callbacks;
+	struct hotplug_device *devices;
+	hid_hotplug_handle next_handle;
+	int running; /* nesting depth of hotplug_notify() */
+} hotplug = { .mutex = PTHREAD_MUTEX_INITIALIZER };
+
 uint16_t get_usb_code_for_current_locale(void);
-static int return_data(hid_device *dev, unsigned char *data, size_t length);
-static int drop_data(hid_device *dev);
+static int return_data(hid_device *dev, unsigned char *data, size_t length, uint64_t *timestamp);
+static void hotplug_stop(void);
+
+/* CLOCK_MONOTONIC in nanoseconds, for the report timestamps. */
+static uint64_t monotonic_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Relaxed atomic counters, see hid_get_stats(). */
+#define STATS_ADD(dev, field, n) \
+	__atomic_fetch_add(&(dev)->stats.field, (n), __ATOMIC_RELAXED)
+
+static void stats_max(uint64_t *counter, uint64_t value)
+{
+	uint64_t cur = __atomic_load_n(counter, __ATOMIC_RELAXED);
+
+	while (value > cur &&
+	       !__atomic_compare_exchange_n(counter, &cur, value, 1,
+			__ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		;
+}
+
+/* Bucket of a value in a struct hid_histogram: the values below 4 get a
+   bucket each, every larger power of two is split in 4. */
+static int histogram_bucket(uint64_t value)
+{
+	int msb;
+
+	if (value < 4)
+		return value;
+	msb = 63 - __builtin_clzll(value);
+	return 4 * (msb - 1) + ((value >> (msb - 2)) & 3);
+}
+
+/* Count value in one of the histograms, if they are enabled. */
+static void histogram_record(hid_device *dev, int type, uint64_t value)
+{
+	struct hid_histogram *h;
+
+	if (!__atomic_load_n(&dev->histograms_enabled, __ATOMIC_ACQUIRE))
+		return;
+	h = dev->histograms + type;
+	__atomic_fetch_add(&h->count, 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&h->buckets[histogram_bucket(value)], 1, __ATOMIC_RELAXED);
+}
 
 static hid_device *new_hid_device(void)
 {
 	hid_device *dev = calloc(1, sizeof(hid_device));
 	dev->blocking = 1;
-	dev->last_input_report = &dev->input_reports;
-	dev->num_queued_reports = 0;
+	dev->queue_capacity = MAX_QUEUE_LEN;
+	dev->queue_policy = HID_QUEUE_DROP_OLDEST;
 
 	pthread_mutex_init(&dev->mutex, NULL);
 	pthread_cond_init(&dev->condition, NULL);
-	pthread_barrier_init(&dev->barrier, NULL, 2);
+	pthread_mutex_init(&dev->writer_mutex, NULL);
+	pthread_cond_init(&dev->writer_condition, NULL);
 
 	/* fixme check error */
+#ifdef __linux__
+	dev->ichan[0] = dev->ichan[1] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (dev->ichan[0] < 0)
+	    LOG("eventfd failed %s\n", strerror(errno));
+#else
 	if (pipe(dev->ichan) < 0)
-	    LOG("read failed %s\n", strerror(errno));
+	    LOG("pipe failed %s\n", strerror(errno));
+	fcntl(dev->ichan[0], F_SETFL, O_NONBLOCK);
+	fcntl(dev->ichan[1], F_SETFL, O_NONBLOCK);
+#endif
 
 	return dev;
 }
@@ -209,11 +347,17 @@ static hid_device *new_hid_device(void)
 static void free_hid_device(hid_device *dev)
 {
 	/* Clean up the thread objects */
-	pthread_barrier_destroy(&dev->barrier);
 	pthread_cond_destroy(&dev->condition);
 	pthread_mutex_destroy(&dev->mutex);
 
+	close(dev->ichan[0]);
+	if (dev->ichan[1] != dev->ichan[0])
+		close(dev->ichan[1]);
+
 	/* Free the device itself */
+	free(dev->input_reports);
+	free(dev->report_data);
+	free(dev->histograms);
 	free(dev);
 }
 
@@ -225,7 +369,6 @@ static void register_error(hid_device *device, const char *op)
 }
 #endif
 
-#ifdef INVASIVE_GET_USAGE
 /* Get bytes from a HID Report Descriptor.
    Only call with a num_bytes of 0, 1, 2, or 4. */
 static uint32_t get_bytes(uint8_t *rpt, size_t len, size_t num_bytes, size_t cur)
@@ -325,7 +468,33 @@ static int get_usage(uint8_t *report_descriptor, size_t size,
 
 	return -1; /* failure */
 }
-#endif /* INVASIVE_GET_USAGE */
+
+/* Whether a HID Report Descriptor has a Report ID item, in which case
+   every report starts with its ID. */
+static int uses_report_ids(uint8_t *report_descriptor, size_t size)
+{
+	unsigned int i = 0;
+
+	while (i < size) {
+		int key = report_descriptor[i];
+		int data_len;
+
+		if ((key & 0xf0) == 0xf0) {
+			/* Long Item, see get_usage(). */
+			data_len = (i+1 < size)? report_descriptor[i+1]: 0;
+			i += data_len + 3;
+			continue;
+		}
+
+		if ((key & 0xfc) == 0x84)
+			return 1;
+
+		data_len = ((key & 0x3) == 3)? 4: (key & 0x3);
+		i += data_len + 1;
+	}
+
+	return 0;
+}
 
 #if defined(__FreeBSD__) && __FreeBSD__ < 10
 /* The libusb version included in FreeBSD < 10 doesn't have this function. In
@@ -503,6 +672,286 @@ static char *make_path(libusb_device *dev, int interface_number)
 	return strdup(str);
 }
 
+/* A report descriptor read when an interface was opened. */
+struct cached_descriptor {
+	int interface;
+	int length;
+	unsigned char *data;
+	unsigned short usage_page;
+	unsigned short usage;
+	struct cached_descriptor *next;
+};
+
+/* What is known about an attached USB device, so that enumerating and
+   opening it don't have to talk to it again. Entries are keyed by the
+   bus, port path and address (which changes on every attach) and the
+   device descriptor, and are dropped by hid_enumerate() once the device
+   is gone. */
+struct device_cache_entry {
+	uint8_t bus;
+	uint8_t address;
+	uint8_t ports[8];
+	int num_ports;
+	struct libusb_device_descriptor desc;
+
+	int strings_read; /* boolean */
+	wchar_t *serial_number;
+	wchar_t *manufacturer_string;
+	wchar_t *product_string;
+
+	struct cached_descriptor *descriptors;
+	struct device_cache_entry *next;
+};
+
+static struct {
+	pthread_mutex_t mutex; /* Protects entries */
+	struct device_cache_entry *entries;
+} device_cache = { PTHREAD_MUTEX_INITIALIZER, NULL };
+
+/* Find or add the cache entry of a device.
+   Call with device_cache.mutex locked. */
+static struct device_cache_entry *device_cache_get(libusb_device *dev, const struct libusb_device_descriptor *desc)
+{
+	struct device_cache_entry *e;
+	uint8_t ports[8];
+	int num_ports = libusb_get_port_numbers(dev, ports, sizeof(ports));
+	uint8_t bus = libusb_get_bus_number(dev);
+	uint8_t address = libusb_get_device_address(dev);
+
+	if (num_ports < 0)
+		num_ports = 0;
+
+	for (e = device_cache.entries; e; e = e->next) {
+		if (e->bus == bus && e->address == address &&
+		    e->num_ports == num_ports &&
+		    memcmp(e->ports, ports, num_ports) == 0 &&
+		    memcmp(&e->desc, desc, sizeof(*desc)) == 0)
+			return e;
+	}
+
+	e = calloc(1, sizeof(struct device_cache_entry));
+	if (!e)
+		return NULL;
+	e->bus = bus;
+	e->address = address;
+	memcpy(e->ports, ports, num_ports);
+	e->num_ports = num_ports;
+	e->desc = *desc;
+	e->next = device_cache.entries;
+	device_cache.entries = e;
+
+	return e;
+}
+
+static void device_cache_free_entry(struct device_cache_entry *e)
+{
+	struct cached_descriptor *d = e->descriptors;
+	while (d) {
+		struct cached_descriptor *next = d->next;
+		free(d->data);
+		free(d);
+		d = next;
+	}
+	free(e->serial_number);
+	free(e->manufacturer_string);
+	free(e->product_string);
+	free(e);
+}
+
+/* Drop the entries of devices which are not in the device list any more.
+   A USB address is unique on its bus while the device is attached. */
+static void device_cache_prune(libusb_device **devs)
+{
+	struct device_cache_entry **e;
+
+	pthread_mutex_lock(&device_cache.mutex);
+	e = &device_cache.entries;
+	while (*e) {
+		int i;
+		int found = 0;
+		for (i = 0; devs[i]; i++) {
+			if (libusb_get_bus_number(devs[i]) == (*e)->bus &&
+			    libusb_get_device_address(devs[i]) == (*e)->address) {
+				found = 1;
+				break;
+			}
+		}
+
+		if (found) {
+			e = &(*e)->next;
+		}
+		else {
+			struct device_cache_entry *gone = *e;
+			*e = gone->next;
+			device_cache_free_entry(gone);
+		}
+	}
+	pthread_mutex_unlock(&device_cache.mutex);
+}
+
+static void device_cache_clear(void)
+{
+	pthread_mutex_lock(&device_cache.mutex);
+	while (device_cache.entries) {
+		struct device_cache_entry *e = device_cache.entries;
+		device_cache.entries = e->next;
+		device_cache_free_entry(e);
+	}
+	pthread_mutex_unlock(&device_cache.mutex);
+}
+
+static struct cached_descriptor *device_cache_find_descriptor(struct device_cache_entry *e, int interface)
+{
+	struct cached_descriptor *d;
+	for (d = e->descriptors; d; d = d->next) {
+		if (d->interface == interface)
+			return d;
+	}
+	return NULL;
+}
+
+/* Read the strings of a device into its cache entry. The device is
+   opened without holding device_cache.mutex: a hotplug callback on the
+   event thread may be waiting for it, and libusb needs that thread to
+   complete the transfers. */
+static void device_cache_read_strings(libusb_device *dev, const struct libusb_device_descriptor *desc)
+{
+	libusb_device_handle *handle;
+	struct device_cache_entry *e;
+	wchar_t *serial_number = NULL;
+	wchar_t *manufacturer_string = NULL;
+	wchar_t *product_string = NULL;
+
+	if (libusb_open(dev, &handle) < 0)
+		return;
+
+	if (desc->iSerialNumber > 0)
+		serial_number = get_usb_string(handle, desc->iSerialNumber);
+	if (desc->iManufacturer > 0)
+		manufacturer_string = get_usb_string(handle, desc->iManufacturer);
+	if (desc->iProduct > 0)
+		product_string = get_usb_string(handle, desc->iProduct);
+
+	libusb_close(handle);
+
+	pthread_mutex_lock(&device_cache.mutex);
+	e = device_cache_get(dev, desc);
+	if (e && !e->strings_read) {
+		e->serial_number = serial_number;
+		e->manufacturer_string = manufacturer_string;
+		e->product_string = product_string;
+		e->strings_read = 1;
+		serial_number = manufacturer_string = product_string = NULL;
+	}
+	pthread_mutex_unlock(&device_cache.mutex);
+
+	/* Another thread was quicker. */
+	free(serial_number);
+	free(manufacturer_string);
+	free(product_string);
+}
+
+/* Fill in the strings and usages of an interface record from the cache,
+   reading the strings from the device the first time it is seen. */
+static void device_cache_fill(struct hid_device_info *info, libusb_device *dev, const struct libusb_device_descriptor *desc)
+{
+	struct device_cache_entry *e;
+	int strings_read;
+
+	pthread_mutex_lock(&device_cache.mutex);
+	e = device_cache_get(dev, desc);
+	strings_read = e && e->strings_read;
+	pthread_mutex_unlock(&device_cache.mutex);
+
+	if (!strings_read)
+		device_cache_read_strings(dev, desc);
+
+	pthread_mutex_lock(&device_cache.mutex);
+	e = device_cache_get(dev, desc);
+	if (e) {
+		struct cached_descriptor *d;
+
+		if (e->serial_number)
+			info->serial_number = wcsdup(e->serial_number);
+		if (e->manufacturer_string)
+			info->manufacturer_string = wcsdup(e->manufacturer_string);
+		if (e->product_string)
+			info->product_string = wcsdup(e->product_string);
+
+		d = device_cache_find_descriptor(e, info->interface_number);
+		if (d) {
+			info->usage_page = d->usage_page;
+			info->usage = d->usage;
+		}
+	}
+	pthread_mutex_unlock(&device_cache.mutex);
+}
+
+/* Copy the report descriptor of the interface of an open device into
+   data (if not NULL), from the cache or read from the device the first
+   time. Returns its length, or -1 on error. */
+static int get_cached_descriptor(hid_device *dev, unsigned char *data, size_t length)
+{
+	libusb_device *usb_dev = libusb_get_device(dev->device_handle);
+	struct libusb_device_descriptor desc;
+	struct device_cache_entry *e;
+	struct cached_descriptor *d;
+	unsigned char buf[4096];
+	int n = -1;
+
+	if (libusb_get_device_descriptor(usb_dev, &desc) < 0)
+		return -1;
+
+	pthread_mutex_lock(&device_cache.mutex);
+	e = device_cache_get(usb_dev, &desc);
+	d = e ? device_cache_find_descriptor(e, dev->interface) : NULL;
+	if (d) {
+		n = d->length;
+		if (data && (size_t)n <= length)
+			memcpy(data, d->data, n);
+	}
+	pthread_mutex_unlock(&device_cache.mutex);
+
+	if (!d) {
+		/* Not under the lock, see device_cache_read_strings(). */
+		n = libusb_control_transfer(dev->device_handle, LIBUSB_ENDPOINT_IN|LIBUSB_RECIPIENT_INTERFACE,
+					LIBUSB_REQUEST_GET_DESCRIPTOR, (LIBUSB_DT_REPORT << 8)|dev->interface,
+					0, buf, sizeof(buf), 5000);
+		if (n < 0) {
+			LOG("libusb_control_transfer() for getting the HID report failed with %d\n", n);
+			return -1;
+		}
+
+		pthread_mutex_lock(&device_cache.mutex);
+		e = device_cache_get(usb_dev, &desc);
+		if (e && !device_cache_find_descriptor(e, dev->interface)) {
+			d = calloc(1, sizeof(struct cached_descriptor));
+			if (d)
+				d->data = malloc(n > 0 ? n : 1);
+			if (d && d->data) {
+				memcpy(d->data, buf, n);
+				d->length = n;
+				d->interface = dev->interface;
+				get_usage(d->data, n, &d->usage_page, &d->usage);
+				d->next = e->descriptors;
+				e->descriptors = d;
+			}
+			else {
+				free(d);
+			}
+		}
+		pthread_mutex_unlock(&device_cache.mutex);
+
+		if (data && (size_t)n <= length)
+			memcpy(data, buf, n);
+	}
+
+	if (data && (size_t)n > length) {
+		errno = ERANGE;
+		return -1;
+	}
+	return n;
+}
 
 int HID_API_EXPORT hid_init(void)
 {
@@ -525,6 +974,8 @@ int HID_API_EXPORT hid_init(void)
 int HID_API_EXPORT hid_exit(void)
 {
 	if (usb_context) {
+		hotplug_stop();
+		device_cache_clear();
 		libusb_exit(usb_context);
 		usb_context = NULL;
 	}
@@ -532,162 +983,186 @@ int HID_API_EXPORT hid_exit(void)
 	return 0;
 }
 
-struct hid_device_info  HID_API_EXPORT *hid_enumerate(unsigned short vendor_id, unsigned short product_id)
+/* Create the records for the HID interfaces of a USB device if it
+   matches vendor_id and product_id (0 matches any). */
+static struct hid_device_info *create_device_info(libusb_device *dev, unsigned short vendor_id, unsigned short product_id)
 {
-	libusb_device **devs;
-	libusb_device *dev;
+#ifdef INVASIVE_GET_USAGE
 	libusb_device_handle *handle;
-	ssize_t num_devs;
-	int i = 0;
+#endif
 
 	struct hid_device_info *root = NULL; /* return object */
 	struct hid_device_info *cur_dev = NULL;
 
-	if(hid_init() < 0)
-		return NULL;
+	struct libusb_device_descriptor desc;
+	struct libusb_config_descriptor *conf_desc = NULL;
+	int j, k;
+	int interface_num = 0;
 
-	num_devs = libusb_get_device_list(usb_context, &devs);
-	if (num_devs < 0)
+	int res = libusb_get_device_descriptor(dev, &desc);
+	unsigned short dev_vid = desc.idVendor;
+	unsigned short dev_pid = desc.idProduct;
+
+	/* Only look at the configuration of devices we are asked about. */
+	if ((vendor_id != 0x0 && vendor_id != dev_vid) ||
+	    (product_id != 0x0 && product_id != dev_pid))
 		return NULL;
-	while ((dev = devs[i++]) != NULL) {
-		struct libusb_device_descriptor desc;
-		struct libusb_config_descriptor *conf_desc = NULL;
-		int j, k;
-		int interface_num = 0;
 
-		int res = libusb_get_device_descriptor(dev, &desc);
-		unsigned short dev_vid = desc.idVendor;
-		unsigned short dev_pid = desc.idProduct;
+	res = libusb_get_active_config_descriptor(dev, &conf_desc);
+	if (res < 0)
+		libusb_get_config_descriptor(dev, 0, &conf_desc);
+	if (conf_desc) {
+		for (j = 0; j < conf_desc->bNumInterfaces; j++) {
+			const struct libusb_interface *intf = &conf_desc->interface[j];
+			for (k = 0; k < intf->num_altsetting; k++) {
+				const struct libusb_interface_descriptor *intf_desc;
+				intf_desc = &intf->altsetting[k];
+				if (intf_desc->bInterfaceClass == LIBUSB_CLASS_HID) {
+					interface_num = intf_desc->bInterfaceNumber;
+
+					/* Check the VID/PID against the arguments */
+					if ((vendor_id == 0x0 || vendor_id == dev_vid) &&
+					    (product_id == 0x0 || product_id == dev_pid)) {
+						struct hid_device_info *tmp;
 
-		res = libusb_get_active_config_descriptor(dev, &conf_desc);
-		if (res < 0)
-			libusb_get_config_descriptor(dev, 0, &conf_desc);
-		if (conf_desc) {
-			for (j = 0; j < conf_desc->bNumInterfaces; j++) {
-				const struct libusb_interface *intf = &conf_desc->interface[j];
-				for (k = 0; k < intf->num_altsetting; k++) {
-					const struct libusb_interface_descriptor *intf_desc;
-					intf_desc = &intf->altsetting[k];
-					if (intf_desc->bInterfaceClass == LIBUSB_CLASS_HID) {
-						interface_num = intf_desc->bInterfaceNumber;
-
-						/* Check the VID/PID against the arguments */
-						if ((vendor_id == 0x0 || vendor_id == dev_vid) &&
-						    (product_id == 0x0 || product_id == dev_pid)) {
-							struct hid_device_info *tmp;
-
-							/* VID/PID match. Create the record. */
-							tmp = calloc(1, sizeof(struct hid_device_info));
-							if (cur_dev) {
-								cur_dev->next = tmp;
-							}
-							else {
-								root = tmp;
-							}
-							cur_dev = tmp;
+						/* VID/PID match. Create the record. */
+						tmp = calloc(1, sizeof(struct hid_device_info));
+						if (cur_dev) {
+							cur_dev->next = tmp;
+						}
+						else {
+							root = tmp;
+						}
+						cur_dev = tmp;
 
-							/* Fill out the record */
-							cur_dev->next = NULL;
-							cur_dev->path = make_path(dev, interface_num);
+						/* Fill out the record */
+						cur_dev->next = NULL;
+						cur_dev->path = make_path(dev, interface_num);
 
-							res = libusb_open(dev, &handle);
+						/* Interface Number */
+						cur_dev->interface_number = interface_num;
 
-							if (res >= 0) {
-								/* Serial Number */
-								if (desc.iSerialNumber > 0)
-									cur_dev->serial_number =
-										get_usb_string(handle, desc.iSerialNumber);
-
-								/* Manufacturer and Product strings */
-								if (desc.iManufacturer > 0)
-									cur_dev->manufacturer_string =
-										get_usb_string(handle, desc.iManufacturer);
-								if (desc.iProduct > 0)
-									cur_dev->product_string =
-										get_usb_string(handle, desc.iProduct);
+						/* The strings are read from the device once
+						   per attach, the usages once the interface
+						   has been opened. */
+						device_cache_fill(cur_dev, dev, &desc);
 
 #ifdef INVASIVE_GET_USAGE
+						res = libusb_open(dev, &handle);
+						if (res >= 0) {
 {
-							/*
-							This section is removed because it is too
-							invasive on the system. Getting a Usage Page
-							and Usage requires parsing the HID Report
-							descriptor. Getting a HID Report descriptor
-							involves claiming the interface. Claiming the
-							interface involves detaching the kernel driver.
-							Detaching the kernel driver is hard on the system
-							because it will unclaim interfaces (if another
-							app has them claimed) and the re-attachment of
-							the driver will sometimes change /dev entry names.
-							It is for these reasons that this section is
-							#if 0. For composite devices, use the interface
-							field in the hid_device_info struct to distinguish
-							between interfaces. */
-								unsigned char data[256];
+						/*
+						This section is removed because it is too
+						invasive on the system. Getting a Usage Page
+						and Usage requires parsing the HID Report
+						descriptor. Getting a HID Report descriptor
+						involves claiming the interface. Claiming the
+						interface involves detaching the kernel driver.
+						Detaching the kernel driver is hard on the system
+						because it will unclaim interfaces (if another
+						app has them claimed) and the re-attachment of
+						the driver will sometimes change /dev entry names.
+						It is for these reasons that this section is
+						#if 0. For composite devices, use the interface
+						field in the hid_device_info struct to distinguish
+						between interfaces. */
+							unsigned char data[256];
 #ifdef DETACH_KERNEL_DRIVER
-								int detached = 0;
-								/* Usage Page and Usage */
-								res = libusb_kernel_driver_active(handle, interface_num);
-								if (res == 1) {
-									res = libusb_detach_kernel_driver(handle, interface_num);
-									if (res < 0)
-										LOG("Couldn't detach kernel driver, even though a kernel driver was attached.");
-									else
-										detached = 1;
-								}
+							int detached = 0;
+							/* Usage Page and Usage */
+							res = libusb_kernel_driver_active(handle, interface_num);
+							if (res == 1) {
+								res = libusb_detach_kernel_driver(handle, interface_num);
+								if (res < 0)
+									LOG("Couldn't detach kernel driver, even though a kernel driver was attached.");
+								else
+									detached = 1;
+							}
 #endif
-								res = libusb_claim_interface(handle, interface_num);
+							res = libusb_claim_interface(handle, interface_num);
+							if (res >= 0) {
+								/* Get the HID Report Descriptor. */
+								res = libusb_control_transfer(handle, LIBUSB_ENDPOINT_IN|LIBUSB_RECIPIENT_INTERFACE, LIBUSB_REQUEST_GET_DESCRIPTOR, (LIBUSB_DT_REPORT << 8)|interface_num, 0, data, sizeof(data), 5000);
 								if (res >= 0) {
-									/* Get the HID Report Descriptor. */
-									res = libusb_control_transfer(handle, LIBUSB_ENDPOINT_IN|LIBUSB_RECIPIENT_INTERFACE, LIBUSB_REQUEST_GET_DESCRIPTOR, (LIBUSB_DT_REPORT << 8)|interface_num, 0, data, sizeof(data), 5000);
-									if (res >= 0) {
-										unsigned short page=0, usage=0;
-										/* Parse the usage and usage page
-										   out of the report descriptor. */
-										get_usage(data, res,  &page, &usage);
-										cur_dev->usage_page = page;
-										cur_dev->usage = usage;
-									}
-									else
-										LOG("libusb_control_transfer() for getting the HID report failed with %d\n", res);
-
-									/* Release the interface */
-									res = libusb_release_interface(handle, interface_num);
-									if (res < 0)
-										LOG("Can't release the interface.\n");
+									unsigned short page=0, usage=0;
+									/* Parse the usage and usage page
+									   out of the report descriptor. */
+									get_usage(data, res,  &page, &usage);
+									cur_dev->usage_page = page;
+									cur_dev->usage = usage;
 								}
 								else
-									LOG("Can't claim interface %d\n", res);
+									LOG("libusb_control_transfer() for getting the HID report failed with %d\n", res);
+
+								/* Release the interface */
+								res = libusb_release_interface(handle, interface_num);
+								if (res < 0)
+									LOG("Can't release the interface.\n");
+							}
+							else
+								LOG("Can't claim interface %d\n", res);
 #ifdef DETACH_KERNEL_DRIVER
-								/* Re-attach kernel driver if necessary. */
-								if (detached) {
-									res = libusb_attach_kernel_driver(handle, interface_num);
-									if (res < 0)
-										LOG("Couldn't re-attach kernel driver.\n");
-								}
+							/* Re-attach kernel driver if necessary. */
+							if (detached) {
+								res = libusb_attach_kernel_driver(handle, interface_num);
+								if (res < 0)
+									LOG("Couldn't re-attach kernel driver.\n");
+							}
 #endif
 }
+							libusb_close(handle);
+						}
 #endif /* INVASIVE_GET_USAGE */
 
-								libusb_close(handle);
-							}
-							/* VID/PID */
-							cur_dev->vendor_id = dev_vid;
-							cur_dev->product_id = dev_pid;
-
-							/* Release Number */
-							cur_dev->release_number = desc.bcdDevice;
+						/* VID/PID */
+						cur_dev->vendor_id = dev_vid;
+						cur_dev->product_id = dev_pid;
 
-							/* Interface Number */
-							cur_dev->interface_number = interface_num;
-						}
+						/* Release Number */
+						cur_dev->release_number = desc.bcdDevice;
 					}
-				} /* altsettings */
-			} /* interfaces */
-			libusb_free_config_descriptor(conf_desc);
+				}
+			} /* altsettings */
+		} /* interfaces */
+		libusb_free_config_descriptor(conf_desc);
+	}
+
+	return root;
+}
+
+struct hid_device_info  HID_API_EXPORT *hid_enumerate(unsigned short vendor_id, unsigned short product_id)
+{
+	libusb_device **devs;
+	libusb_device *dev;
+	ssize_t num_devs;
+	int i = 0;
+
+	struct hid_device_info *root = NULL; /* return object */
+	struct hid_device_info *cur_dev = NULL;
+
+	if(hid_init() < 0)
+		return NULL;
+
+	num_devs = libusb_get_device_list(usb_context, &devs);
+	if (num_devs < 0)
+		return NULL;
+	while ((dev = devs[i++]) != NULL) {
+		struct hid_device_info *tmp = create_device_info(dev, vendor_id, product_id);
+		if (!tmp)
+			continue;
+
+		if (cur_dev) {
+			cur_dev->next = tmp;
+		}
+		else {
+			root = tmp;
 		}
+		/* One record per HID interface. */
+		for (cur_dev = tmp; cur_dev->next; cur_dev = cur_dev->next)
+			;
 	}
 
+	device_cache_prune(devs);
 	libusb_free_device_list(devs, 1);
 
 	return root;
@@ -707,6 +1182,30 @@ void  HID_API_EXPORT hid_free_enumeration(struct hid_device_info *devs)
 	}
 }
 
+struct hid_device_info  HID_API_EXPORT *hid_enumerate_usage(unsigned short vendor_id, unsigned short product_id, unsigned short usage_page, unsigned short usage)
+{
+	struct hid_device_info *root = hid_enumerate(vendor_id, product_id);
+	struct hid_device_info **d = &root;
+
+	/* No device has been opened for the records, the ones which don't
+	   match are only dropped again. */
+	while (*d) {
+		struct hid_device_info *cur = *d;
+
+		if ((usage_page == 0x0 || usage_page == cur->usage_page) &&
+		    (usage == 0x0 || usage == cur->usage)) {
+			d = &cur->next;
+			continue;
+		}
+
+		*d = cur->next;
+		cur->next = NULL;
+		hid_free_enumeration(cur);
+	}
+
+	return root;
+}
+
 hid_device * hid_open(unsigned short vendor_id, unsigned short product_id, const wchar_t *serial_number)
 {
 	struct hid_device_info *devs, *cur_dev;
@@ -743,47 +1242,222 @@ hid_device * hid_open(unsigned short vendor_id, unsigned short product_id, const
 	return handle;
 }
 
-static void read_callback(struct libusb_transfer *transfer)
+/* Called when a transfer is not resubmitted. The other transfers keep
+   cycling, unless shutdown_thread is set. Once none is left there is
+   no more input, so wake any threads which are waiting on data (in
+   hid_read_timeout()). Do this under a mutex to make sure that a thread
+   which is about to go to sleep waiting on the condition acutally will
+   go to sleep before the condition is signaled. */
+static void transfer_done(hid_device *dev)
 {
-	hid_device *dev = transfer->user_data;
-	int res;
-
-	if (transfer->status == LIBUSB_TRANSFER_COMPLETED) {
-
-	    struct input_report *rpt;
-		rpt = malloc(sizeof(struct input_report)+
-			     transfer->actual_length);
-		memcpy(rpt->data, transfer->buffer, transfer->actual_length);
-		rpt->len = transfer->actual_length;
-		rpt->next = NULL;
-
+	if (__atomic_sub_fetch(&dev->num_active_transfers, 1, __ATOMIC_SEQ_CST) == 0) {
 		pthread_mutex_lock(&dev->mutex);
+		dev->shutdown_thread = 1;
+		dev->cancelled = 1;
+		pthread_cond_broadcast(&dev->condition);
+		pthread_mutex_unlock(&dev->mutex);
+	}
+}
 
-		*dev->last_input_report = rpt;
-		dev->last_input_report = &(rpt->next);
-		dev->num_queued_reports++;
-
-		if (dev->num_queued_reports > MAX_QUEUE_LEN)
-		    drop_data(dev);
+static void write_event(hid_device *dev)
+{
+#ifdef __linux__
+	if (eventfd_write(dev->ichan[1], 1) < 0)
+#else
+	if (write(dev->ichan[1], "!", 1) < 1)
+#endif
+		LOG("write failed %s\n", strerror(errno));
+}
+
+/* Make ichan readable, if it isn't yet. Called after every queued
+   report, but only makes a system call when the ring was empty. */
+static void signal_events(hid_device *dev)
+{
+	if (!__atomic_exchange_n(&dev->signalled, 1, __ATOMIC_SEQ_CST))
+		write_event(dev);
+}
+
+/* Whether the ring is only touched with mutex locked, see
+   hid_set_input_queue(). Otherwise read_callback() and the readers
+   share it without a lock. */
+static int queue_locked(hid_device *dev)
+{
+	return dev->queue_policy == HID_QUEUE_COALESCE ||
+	       dev->queue_policy == HID_QUEUE_BLOCK;
+}
+
+/* Account for a report which didn't fit into the ring. */
+static void overflow(hid_device *dev, const unsigned char *data, size_t length)
+{
+	if (dev->queue_policy != HID_QUEUE_BLOCK) {
+		STATS_ADD(dev, reports_dropped, 1);
+		HID_PROBE1(queue_drop, dev);
+	}
+	if (dev->overflow_callback)
+		dev->overflow_callback(dev, data, length, dev->overflow_callback_data);
+}
+
+/* Put a report into the slot at head, which must be free, and publish it. */
+static void store_report(hid_device *dev, unsigned int head, unsigned int tail, const unsigned char *data, size_t length, uint64_t timestamp)
+{
+	struct input_report *rpt = &dev->input_reports[head % dev->queue_capacity];
+
+	memcpy(rpt->data, data, length);
+	rpt->len = length;
+	rpt->timestamp = timestamp;
+	__atomic_store_n(&dev->head, head + 1, __ATOMIC_SEQ_CST);
+
+	stats_max(&dev->stats.max_queue_depth, head + 1 - tail);
+	HID_PROBE2(queue_enqueue, dev, head + 1 - tail);
+}
+
+/* Queue the report of a completed transfer according to queue_policy.
+   Returns 1 if it was added to the ring, 0 if not, and -1 if the
+   transfer was parked and must not be resubmitted. */
+static int queue_report(hid_device *dev, struct libusb_transfer *transfer, uint64_t timestamp)
+{
+	const unsigned char *data = transfer->buffer;
+	const size_t length = transfer->actual_length;
+	unsigned int head, tail;
+	int res = 1;
+
+	if (!queue_locked(dev)) {
+		/* Make room by dropping the oldest report. The reader may
+		   take it first, then the CAS fails and there is room. */
+		head = dev->head;
+		tail = __atomic_load_n(&dev->tail, __ATOMIC_ACQUIRE);
+		while (head - tail == dev->queue_capacity) {
+			if (dev->queue_policy == HID_QUEUE_DROP_NEWEST) {
+				overflow(dev, data, length);
+				return 0;
+			}
+			if (__atomic_compare_exchange_n(&dev->tail, &tail, tail + 1, 0,
+					__ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+				/* The slot is ours now, it is the one at head. */
+				struct input_report *rpt = &dev->input_reports[head % dev->queue_capacity];
+				overflow(dev, rpt->data, rpt->len);
+				tail++;
+			}
+		}
+		store_report(dev, head, tail, data, length, timestamp);
+		return 1;
+	}
+
+	pthread_mutex_lock(&dev->mutex);
+	head = dev->head;
+	tail = dev->tail;
+	if (dev->queue_policy == HID_QUEUE_BLOCK) {
+		/* Keep the order: once one is parked, park all. */
+		if (dev->num_parked > 0 || head - tail == dev->queue_capacity) {
+			if (dev->shutdown_thread) {
+				res = 0;
+			}
+			else {
+				dev->parked_timestamps[dev->num_parked] = timestamp;
+				dev->parked[dev->num_parked++] = transfer;
+				overflow(dev, data, length);
+				res = -1;
+			}
+		}
+	}
+	else {
+		/* HID_QUEUE_COALESCE. Without report IDs all reports are
+		   the same one. */
+		unsigned int i;
+		for (i = tail; i != head; i++) {
+			struct input_report *rpt = &dev->input_reports[i % dev->queue_capacity];
+			if (!dev->uses_report_ids ||
+			    (length > 0 && rpt->len > 0 && rpt->data[0] == data[0])) {
+				memcpy(rpt->data, data, length);
+				rpt->len = length;
+				rpt->timestamp = timestamp;
+				STATS_ADD(dev, reports_coalesced, 1);
+				res = 0;
+				break;
+			}
+		}
+		if (res && head - tail == dev->queue_capacity) {
+			struct input_report *rpt = &dev->input_reports[tail % dev->queue_capacity];
+			overflow(dev, rpt->data, rpt->len);
+			__atomic_store_n(&dev->tail, ++tail, __ATOMIC_SEQ_CST);
+		}
+	}
+	if (res > 0)
+		store_report(dev, head, tail, data, length, timestamp);
+	pthread_mutex_unlock(&dev->mutex);
+
+	return res;
+}
+
+static void read_callback(struct libusb_transfer *transfer)
+{
+	hid_device *dev = transfer->user_data;
+	int res;
+
+	if (transfer->status == LIBUSB_TRANSFER_COMPLETED) {
+		hid_input_report_callback callback;
+		int queue_reports = 1;
+		uint64_t timestamp = monotonic_ns();
+
+		STATS_ADD(dev, reports_received, 1);
+		STATS_ADD(dev, bytes_received, transfer->actual_length);
+		if (dev->last_report)
+			histogram_record(dev, HID_HISTOGRAM_REPORT_INTERVAL, timestamp - dev->last_report);
+		dev->last_report = timestamp;
+		HID_PROBE3(report_receive, dev, transfer->actual_length, timestamp);
+
+		/* delivering is set before the callback and the queue are
+		   looked at, see hid_set_input_report_callback() and
+		   hid_set_input_queue(). */
+		__atomic_store_n(&dev->delivering, 1, __ATOMIC_SEQ_CST);
+
+		/* Hand the report over while it is still in the transfer
+		   buffer. Nothing is copied unless the report is queued too. */
+		callback = __atomic_load_n(&dev->input_callback, __ATOMIC_SEQ_CST);
+		if (callback) {
+			queue_reports = dev->queue_reports;
+			callback(dev, transfer->buffer, transfer->actual_length,
+				timestamp, dev->input_callback_data);
+		}
+
+		if (!queue_reports) {
+			res = 0;
+		}
+		else if (__atomic_load_n(&dev->queue_paused, __ATOMIC_SEQ_CST)) {
+			STATS_ADD(dev, reports_dropped, 1);
+			res = 0;
+		}
 		else {
-		    /* an client that poll on event handle may use this to poll for
-		     * new input data
-		     */
-		    if (write(dev->ichan[1], "!", 1) < 1)
-			LOG("read failed %s\n", strerror(errno));
+			res = queue_report(dev, transfer, timestamp);
 		}
+		__atomic_store_n(&dev->delivering, 0, __ATOMIC_RELEASE);
 
-		pthread_cond_signal(&dev->condition);
-		pthread_mutex_unlock(&dev->mutex);
+		if (res < 0)
+			return;
+		if (res == 0)
+			goto resubmit;
+
+		/* an client that poll on event handle may use this to poll for
+		 * new input data
+		 */
+		signal_events(dev);
+
+		/* Only wake a reader which is (about to be) asleep, see
+		   wait_for_data(). */
+		if (__atomic_load_n(&dev->num_waiting, __ATOMIC_SEQ_CST)) {
+			pthread_mutex_lock(&dev->mutex);
+			pthread_cond_signal(&dev->condition);
+			pthread_mutex_unlock(&dev->mutex);
+		}
 	}
 	else if (transfer->status == LIBUSB_TRANSFER_CANCELLED) {
-		dev->shutdown_thread = 1;
-		dev->cancelled = 1;
+		transfer_done(dev);
 		return;
 	}
 	else if (transfer->status == LIBUSB_TRANSFER_NO_DEVICE) {
+		/* Don't resubmit the others either. */
 		dev->shutdown_thread = 1;
-		dev->cancelled = 1;
+		transfer_done(dev);
 		return;
 	}
 	else if (transfer->status == LIBUSB_TRANSFER_TIMED_OUT) {
@@ -793,84 +1467,152 @@ static void read_callback(struct libusb_transfer *transfer)
 		LOG("Unknown transfer code: %d\n", transfer->status);
 	}
 
-	/* Re-submit the transfer object. */
+resubmit:
+	if (dev->shutdown_thread) {
+		transfer_done(dev);
+		return;
+	}
+
+	/* Re-submit the transfer object. The other transfers stay
+	   submitted meanwhile, so the endpoint is never left without one. */
 	res = libusb_submit_transfer(transfer);
 	if (res != 0) {
 		LOG("Unable to submit URB. libusb error code: %d\n", res);
-		dev->shutdown_thread = 1;
-		dev->cancelled = 1;
+		transfer_done(dev);
 	}
 }
 
 
-static void *read_thread(void *param)
+static void *event_thread(void *param)
 {
-	hid_device *dev = param;
-	unsigned char *buf;
-	const size_t length = dev->input_ep_max_packet_size;
-
-	/* Set up the transfer object. */
-	buf = malloc(length);
-	dev->transfer = libusb_alloc_transfer(0);
-	libusb_fill_interrupt_transfer(dev->transfer,
-		dev->device_handle,
-		dev->input_endpoint,
-		buf,
-		length,
-		read_callback,
-		dev,
-		5000/*timeout*/);
-
-	/* Make the first submission. Further submissions are made
-	   from inside read_callback() */
-	libusb_submit_transfer(dev->transfer);
-
-	/* Notify the main thread that the read thread is up and running. */
-	pthread_barrier_wait(&dev->barrier);
-
-	/* Handle all the events. */
-	while (!dev->shutdown_thread) {
+	while (!events.shutdown_thread) {
+		struct timeval tv = { 1, 0 };
 		int res;
-		res = libusb_handle_events(usb_context);
-		if (res < 0) {
-			/* There was an error. */
-			LOG("read_thread(): libusb reports error # %d\n", res);
 
-			/* Break out of this loop only on fatal error.*/
-			if (res != LIBUSB_ERROR_BUSY &&
-			    res != LIBUSB_ERROR_TIMEOUT &&
-			    res != LIBUSB_ERROR_OVERFLOW &&
-			    res != LIBUSB_ERROR_INTERRUPTED) {
-				break;
-			}
+		res = libusb_handle_events_timeout_completed(usb_context, &tv, &events.shutdown_thread);
+		if (res < 0 && res != LIBUSB_ERROR_INTERRUPTED) {
+			/* There was an error. */
+			LOG("event_thread(): libusb reports error # %d\n", res);
 		}
 	}
 
-	/* Cancel any transfer that may be pending. This call will fail
-	   if no transfers are pending, but that's OK. */
-	libusb_cancel_transfer(dev->transfer);
+	return NULL;
+}
 
-	while (!dev->cancelled)
-		libusb_handle_events_completed(usb_context, &dev->cancelled);
+/* Start event_thread() for the first user. */
+static int events_ref(void)
+{
+	int res = 0;
 
-	/* Now that the read thread is stopping, Wake any threads which are
-	   waiting on data (in hid_read_timeout()). Do this under a mutex to
-	   make sure that a thread which is about to go to sleep waiting on
-	   the condition acutally will go to sleep before the condition is
-	   signaled. */
-	pthread_mutex_lock(&dev->mutex);
-	pthread_cond_broadcast(&dev->condition);
-	pthread_mutex_unlock(&dev->mutex);
+	pthread_mutex_lock(&events.mutex);
+	if (events.users == 0) {
+		events.shutdown_thread = 0;
+		res = pthread_create(&events.thread, NULL, event_thread, NULL);
+	}
+	if (res == 0)
+		events.users++;
+	pthread_mutex_unlock(&events.mutex);
 
-	/* The dev->transfer->buffer and dev->transfer objects are cleaned up
-	   in hid_close(). They are not cleaned up here because this thread
-	   could end either due to a disconnect or due to a user
-	   call to hid_close(). In both cases the objects can be safely
-	   cleaned up after the call to pthread_join() (in hid_close()), but
-	   since hid_close() calls libusb_cancel_transfer(), on these objects,
-	   they can not be cleaned up here. */
+	return (res == 0)? 0: -1;
+}
 
-	return NULL;
+/* Whether the caller runs on event_thread(), where every callback of an
+   open device is called. Without users, events.thread is a thread which
+   has been joined, and its id may belong to another thread by now. */
+static int events_on_thread(void)
+{
+	return __atomic_load_n(&events.users, __ATOMIC_SEQ_CST) > 0 &&
+		pthread_equal(pthread_self(), events.thread);
+}
+
+/* Stop event_thread() when the last user is gone. */
+static void events_unref(void)
+{
+	pthread_mutex_lock(&events.mutex);
+	if (--events.users == 0) {
+		events.shutdown_thread = 1;
+#if defined(LIBUSB_API_VERSION) && (LIBUSB_API_VERSION >= 0x01000105)
+		libusb_interrupt_event_handler(usb_context);
+#endif
+		pthread_join(events.thread, NULL);
+	}
+	pthread_mutex_unlock(&events.mutex);
+}
+
+/* Allocate a report ring of capacity slots of length bytes. */
+static int alloc_ring(unsigned int capacity, size_t length, struct input_report **reports, uint8_t **data)
+{
+	unsigned int i;
+
+	*reports = calloc(capacity, sizeof(struct input_report));
+	*data = malloc(capacity * length);
+	if (!*reports || !*data) {
+		free(*reports);
+		free(*data);
+		*reports = NULL;
+		*data = NULL;
+		return -1;
+	}
+	for (i = 0; i < capacity; i++)
+		(*reports)[i].data = *data + i * length;
+
+	return 0;
+}
+
+/* Set up the report ring and submit the Input transfers. Returns -1
+   if the ring or the transfers can't be allocated, nothing is
+   submitted then. */
+static int start_input(hid_device *dev)
+{
+	unsigned char *buf;
+	const size_t length = dev->input_ep_max_packet_size;
+	int i;
+
+	/* Without an Input endpoint nothing is ever received, and there
+	   is nothing for hid_close() to cancel. */
+	if (dev->input_endpoint == 0) {
+		dev->cancelled = 1;
+		return 0;
+	}
+
+	/* Set up the report ring. */
+	if (alloc_ring(dev->queue_capacity, length, &dev->input_reports, &dev->report_data) < 0)
+		return -1;
+
+	/* Set up the transfer objects. */
+	for (i = 0; i < num_input_transfers; i++) {
+		buf = malloc(length);
+		dev->transfers[i] = libusb_alloc_transfer(0);
+		if (!buf || !dev->transfers[i]) {
+			free(buf);
+			libusb_free_transfer(dev->transfers[i]);
+			while (i-- > 0) {
+				free(dev->transfers[i]->buffer);
+				libusb_free_transfer(dev->transfers[i]);
+			}
+			return -1;
+		}
+		libusb_fill_interrupt_transfer(dev->transfers[i],
+			dev->device_handle,
+			dev->input_endpoint,
+			buf,
+			length,
+			read_callback,
+			dev,
+			5000/*timeout*/);
+	}
+
+	/* Make the first submissions. Further submissions are made from
+	   inside read_callback(). libusb completes the transfers of an
+	   endpoint in order. */
+	dev->num_transfers = num_input_transfers;
+	for (i = 0; i < dev->num_transfers; i++) {
+		__atomic_add_fetch(&dev->num_active_transfers, 1, __ATOMIC_SEQ_CST);
+		if (libusb_submit_transfer(dev->transfers[i]) != 0)
+			transfer_done(dev);
+	}
+
+	return 0;
 }
 
 
@@ -880,6 +1622,7 @@ hid_device * HID_API_EXPORT hid_open_path(const char *path)
 
 	libusb_device **devs;
 	libusb_device *usb_dev;
+	unsigned char report_descriptor[4096];
 	int res;
 	int d = 0;
 	int good_open = 0;
@@ -947,6 +1690,14 @@ hid_device * HID_API_EXPORT hid_open_path(const char *path)
 						/* Store off the interface number */
 						dev->interface = intf_desc->bInterfaceNumber;
 
+						/* Read the report descriptor once per attach,
+						   so hid_enumerate() can report the usages of
+						   this interface from now on. It also tells
+						   whether reports start with their ID. */
+						res = get_cached_descriptor(dev, report_descriptor, sizeof(report_descriptor));
+						if (res > 0)
+							dev->uses_report_ids = uses_report_ids(report_descriptor, res);
+
 						/* Find the INPUT and OUTPUT endpoints. An
 						   OUTPUT endpoint is not required. */
 						for (i = 0; i < intf_desc->bNumEndpoints; i++) {
@@ -979,10 +1730,21 @@ hid_device * HID_API_EXPORT hid_open_path(const char *path)
 							}
 						}
 
-						pthread_create(&dev->thread, NULL, read_thread, dev);
-
-						/* Wait here for the read thread to be initialized. */
-						pthread_barrier_wait(&dev->barrier);
+						if (events_ref() < 0) {
+							libusb_release_interface(dev->device_handle, dev->interface);
+							libusb_close(dev->device_handle);
+							free(dev_path);
+							good_open = 0;
+							break;
+						}
+						if (start_input(dev) < 0) {
+							events_unref();
+							libusb_release_interface(dev->device_handle, dev->interface);
+							libusb_close(dev->device_handle);
+							free(dev_path);
+							good_open = 0;
+							break;
+						}
 
 					}
 					free(dev_path);
@@ -1009,27 +1771,11 @@ hid_device * HID_API_EXPORT hid_open_path(const char *path)
 /* Get the HID Report Descriptor. */
 int HID_API_EXPORT hid_get_report_descriptor(hid_device *dev, unsigned char *data, size_t length)
 {
-    libusb_device_handle *handle;
-    unsigned char buf[4096];
-    int n;
-
-    handle = dev->device_handle;
-    n = libusb_control_transfer(handle, LIBUSB_ENDPOINT_IN|LIBUSB_RECIPIENT_INTERFACE,
-				LIBUSB_REQUEST_GET_DESCRIPTOR, (LIBUSB_DT_REPORT << 8)|dev->interface, 
-				0, buf, sizeof(buf), 5000);
-    if (n >= 0) {
-	if (n > length) {
-	    errno = ERANGE;
-	    return -1;
-	}
-	memcpy(data, buf, n);
-	return n;
-    }
-    return -1;
+	return get_cached_descriptor(dev, data, length);
 }
 
 
-int HID_API_EXPORT hid_write(hid_device *dev, const unsigned char *data, size_t length)
+static int write_report(hid_device *dev, const unsigned char *data, size_t length)
 {
 	int res;
 	int report_number = data[0];
@@ -1079,180 +1825,1109 @@ int HID_API_EXPORT hid_write(hid_device *dev, const unsigned char *data, size_t
 	}
 }
 
-/* Helper function, to simplify hid_read().
-   This should be called with dev->mutex locked. */
-static int return_data(hid_device *dev, unsigned char *data, size_t length)
+/* Count a finished write in the statistics. */
+static void count_write(hid_device *dev, size_t length, uint64_t duration)
 {
-	/* Copy the data out of the linked list item (rpt) into the
-	   return buffer (data), and delete the liked list item. */
-	struct input_report *rpt = dev->input_reports;
-	if (rpt) {
-	    size_t len = (length < rpt->len)? length: rpt->len;
-	    char buf[1];
-	    
-	    memcpy(data, rpt->data, len);
-	    if (read(dev->ichan[0], buf, 1) < 1)  /* clear event */
-		LOG("read failed %s\n", strerror(errno));
-	    dev->num_queued_reports--;
-
-	    if ((dev->input_reports = rpt->next) == NULL) /* empty */
-		dev->last_input_report = &dev->input_reports;
-	    free(rpt);
-	    return len;
-	}
-	return 0;
+	STATS_ADD(dev, writes, 1);
+	STATS_ADD(dev, write_time_ns, duration);
+	stats_max(&dev->stats.max_write_time_ns, duration);
+	histogram_record(dev, HID_HISTOGRAM_WRITE, duration);
+	HID_PROBE3(write, dev, length, duration);
 }
 
-static int drop_data(hid_device *dev)
+int HID_API_EXPORT hid_write(hid_device *dev, const unsigned char *data, size_t length)
 {
-	struct input_report *rpt = dev->input_reports;
-	if (rpt) {
-	    dev->num_queued_reports--;
-	    if ((dev->input_reports = rpt->next) == NULL) /* empty */
-		dev->last_input_report = &dev->input_reports;
-	    free(rpt);
-	    return 1;
-	}
-	return 0;
+	int res;
+	uint64_t start = monotonic_ns();
+
+	res = write_report(dev, data, length);
+
+	count_write(dev, length, monotonic_ns() - start);
+
+	return res;
 }
 
-static void cleanup_mutex(void *param)
+/* Completion of a hid_write_async() transfer, on the event thread. */
+static void write_callback(struct libusb_transfer *transfer)
 {
-	hid_device *dev = param;
-	pthread_mutex_unlock(&dev->mutex);
-}
+	struct write_transfer *w = transfer->user_data;
+	hid_device *dev = w->dev;
+	hid_write_callback callback = w->callback;
+	void *user_data = w->user_data;
+	int res = -1;
 
+	if (transfer->status == LIBUSB_TRANSFER_COMPLETED)
+		res = transfer->actual_length + w->skipped_report_id;
+	count_write(dev, w->length, monotonic_ns() - w->start);
 
-int HID_API_EXPORT hid_read_timeout(hid_device *dev, unsigned char *data, size_t length, int milliseconds)
-{
-	int bytes_read = -1;
+	/* Free the slot first, so the callback can write again. hid_close()
+	   also waits for write_callbacks, dev stays valid until the
+	   callback has returned. */
+	__atomic_fetch_add(&dev->write_callbacks, 1, __ATOMIC_RELAXED);
+	__atomic_fetch_and(&dev->writes_busy, ~(1u << (w - dev->writes)), __ATOMIC_RELEASE);
 
-#if 0
-	int transferred;
-	int res = libusb_interrupt_transfer(dev->device_handle, dev->input_endpoint, data, length, &transferred, 5000);
-	LOG("transferred: %d\n", transferred);
-	return transferred;
-#endif
+	if (callback)
+		callback(dev, res, user_data);
+	__atomic_fetch_sub(&dev->write_callbacks, 1, __ATOMIC_RELEASE);
+}
 
-	pthread_mutex_lock(&dev->mutex);
-	pthread_cleanup_push(&cleanup_mutex, dev);
+int HID_API_EXPORT hid_write_async(hid_device *dev, const unsigned char *data, size_t length, hid_write_callback callback, void *user_data)
+{
+	struct write_transfer *w;
+	unsigned int busy;
+	unsigned char *buf;
+	int slot, report_number, res;
 
-	/* There's an input report queued up. Return it. */
-	if (dev->input_reports) {
-		/* Return the first one */
-		bytes_read = return_data(dev, data, length);
-		goto ret;
+	if (length == 0) {
+		errno = EINVAL;
+		return -1;
 	}
-
 	if (dev->shutdown_thread) {
-		/* This means the device has been disconnected.
-		   An error code of -1 should be returned. */
-		bytes_read = -1;
-		goto ret;
+		errno = ENODEV;
+		return -1;
 	}
 
-	if (milliseconds == -1) {
-		/* Blocking */
-		while (!dev->input_reports && !dev->shutdown_thread) {
-			pthread_cond_wait(&dev->condition, &dev->mutex);
+	/* Take a free slot. */
+	busy = __atomic_load_n(&dev->writes_busy, __ATOMIC_ACQUIRE);
+	do {
+		if (busy == (1u << MAX_WRITE_TRANSFERS) - 1) {
+			errno = EAGAIN;
+			return -1;
 		}
-		if (dev->input_reports) {
-			bytes_read = return_data(dev, data, length);
+		slot = __builtin_ctz(~busy);
+	} while (!__atomic_compare_exchange_n(&dev->writes_busy, &busy, busy | (1u << slot), 1,
+			__ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE));
+	w = &dev->writes[slot];
+
+	if (!w->transfer)
+		w->transfer = libusb_alloc_transfer(0);
+	buf = w->transfer? w->transfer->buffer: NULL;
+	if (w->transfer && w->buffer_size < LIBUSB_CONTROL_SETUP_SIZE + length) {
+		buf = realloc(buf, LIBUSB_CONTROL_SETUP_SIZE + length);
+		if (buf) {
+			w->transfer->buffer = buf;
+			w->buffer_size = LIBUSB_CONTROL_SETUP_SIZE + length;
 		}
 	}
-	else if (milliseconds > 0) {
-		/* Non-blocking, but called with timeout. */
-		int res;
-		struct timespec ts;
-		clock_gettime(CLOCK_REALTIME, &ts);
-		ts.tv_sec += milliseconds / 1000;
-		ts.tv_nsec += (milliseconds % 1000) * 1000000;
-		if (ts.tv_nsec >= 1000000000L) {
-			ts.tv_sec++;
-			ts.tv_nsec -= 1000000000L;
-		}
+	if (!buf) {
+		__atomic_fetch_and(&dev->writes_busy, ~(1u << slot), __ATOMIC_RELEASE);
+		errno = ENOMEM;
+		return -1;
+	}
 
-		while (!dev->input_reports && !dev->shutdown_thread) {
-			res = pthread_cond_timedwait(&dev->condition, &dev->mutex, &ts);
-			if (res == 0) {
-				if (dev->input_reports) {
-					bytes_read = return_data(dev, data, length);
-					break;
-				}
+	w->dev = dev;
+	w->length = length;
+	w->callback = callback;
+	w->user_data = user_data;
 
-				/* If we're here, there was a spurious wake up
-				   or the read thread was shutdown. Run the
-				   loop again (ie: don't break). */
-			}
-			else if (res == ETIMEDOUT) {
-				/* Timed out. */
-				bytes_read = 0;
-				break;
-			}
-			else {
-				/* Error. */
-				bytes_read = -1;
-				break;
-			}
-		}
+	/* Same as write_report() */
+	report_number = data[0];
+	w->skipped_report_id = 0;
+	if (report_number == 0x0) {
+		data++;
+		length--;
+		w->skipped_report_id = 1;
+	}
+
+	if (dev->output_endpoint <= 0) {
+		/* No interrput out endpoint. Use the Control Endpoint */
+		libusb_fill_control_setup(buf,
+			LIBUSB_REQUEST_TYPE_CLASS|LIBUSB_RECIPIENT_INTERFACE|LIBUSB_ENDPOINT_OUT,
+			0x09/*HID Set_Report*/,
+			(2/*HID output*/ << 8) | report_number,
+			dev->interface,
+			length);
+		memcpy(buf + LIBUSB_CONTROL_SETUP_SIZE, data, length);
+		libusb_fill_control_transfer(w->transfer, dev->device_handle,
+			buf, write_callback, w, 1000/*timeout millis*/);
 	}
 	else {
-		/* Purely non-blocking */
-		bytes_read = 0;
+		/* Use the interrupt out endpoint */
+		memcpy(buf, data, length);
+		libusb_fill_interrupt_transfer(w->transfer, dev->device_handle,
+			dev->output_endpoint, buf, length,
+			write_callback, w, 1000/*timeout millis*/);
 	}
 
-ret:
-	pthread_mutex_unlock(&dev->mutex);
-	pthread_cleanup_pop(0);
+	w->start = monotonic_ns();
+	res = libusb_submit_transfer(w->transfer);
+	if (res != 0) {
+		LOG("Unable to submit URB. libusb error code: %d\n", res);
+		__atomic_fetch_and(&dev->writes_busy, ~(1u << slot), __ATOMIC_RELEASE);
+		errno = (res == LIBUSB_ERROR_NO_DEVICE)? ENODEV: EIO;
+		return -1;
+	}
 
-	return bytes_read;
+	return 0;
 }
 
-int HID_API_EXPORT hid_read(hid_device *dev, unsigned char *data, size_t length)
+/* Send the pending reports of hid_write_latest(), oldest report ID
+   first, as fast as hid_write() returns. */
+static void *writer_thread(void *param)
 {
-	return hid_read_timeout(dev, data, length, dev->blocking ? -1 : 0);
-}
+	hid_device *dev = param;
+	struct pending_report *rpt;
 
-int HID_API_EXPORT hid_set_nonblocking(hid_device *dev, int nonblock)
-{
-	dev->blocking = !nonblock;
+	pthread_mutex_lock(&dev->writer_mutex);
+	while (!dev->writer_shutdown) {
+		rpt = dev->pending_reports;
+		if (!rpt) {
+			pthread_cond_wait(&dev->writer_condition, &dev->writer_mutex);
+			continue;
+		}
+		dev->pending_reports = rpt->next;
+		pthread_mutex_unlock(&dev->writer_mutex);
 
-	return 0;
-}
+		hid_write(dev, rpt->data, rpt->length);
 
-// return an event handle that can be used for poll/epoll/select etc
-hid_handle_t HID_API_EXPORT hid_get_event_handle(hid_device *dev)
-{
-    return (hid_handle_t) ((intptr_t)dev->ichan[0]);
-}
+		pthread_mutex_lock(&dev->writer_mutex);
+		rpt->next = dev->free_reports;
+		dev->free_reports = rpt;
+	}
+	pthread_mutex_unlock(&dev->writer_mutex);
 
+	return NULL;
+}
 
-int HID_API_EXPORT hid_send_feature_report(hid_device *dev, const unsigned char *data, size_t length)
+int HID_API_EXPORT hid_write_latest(hid_device *dev, const unsigned char *data, size_t length)
 {
-	int res = -1;
-	int skipped_report_id = 0;
-	int report_number = data[0];
+	struct pending_report *rpt, **r;
 
-	if (report_number == 0x0) {
-		data++;
-		length--;
-		skipped_report_id = 1;
+	if (length == 0) {
+		errno = EINVAL;
+		return -1;
 	}
 
-	res = libusb_control_transfer(dev->device_handle,
-		LIBUSB_REQUEST_TYPE_CLASS|LIBUSB_RECIPIENT_INTERFACE|LIBUSB_ENDPOINT_OUT,
-		0x09/*HID set_report*/,
-		(3/*HID feature*/ << 8) | report_number,
-		dev->interface,
-		(unsigned char *)data, length,
-		1000/*timeout millis*/);
-
-	if (res < 0)
-		return -1;
+	pthread_mutex_lock(&dev->writer_mutex);
 
-	/* Account for the report ID */
-	if (skipped_report_id)
-		length++;
+	if (!dev->writer_started) {
+		if (pthread_create(&dev->writer, NULL, writer_thread, dev) != 0) {
+			pthread_mutex_unlock(&dev->writer_mutex);
+			return -1;
+		}
+		dev->writer_started = 1;
+	}
+
+	/* Replace a pending report with the same report ID, or queue a
+	   new one. */
+	for (r = &dev->pending_reports; *r; r = &(*r)->next) {
+		if ((*r)->data[0] == data[0])
+			break;
+	}
+	rpt = *r;
+	if (!rpt) {
+		rpt = dev->free_reports;
+		if (rpt)
+			dev->free_reports = rpt->next;
+		else
+			rpt = calloc(1, sizeof(struct pending_report));
+	}
+	if (rpt && rpt->size < length) {
+		unsigned char *buf = realloc(rpt->data, length);
+		if (buf) {
+			rpt->data = buf;
+			rpt->size = length;
+		}
+	}
+	if (!rpt || rpt->size < length) {
+		if (rpt && rpt != *r) {
+			rpt->next = dev->free_reports;
+			dev->free_reports = rpt;
+		}
+		pthread_mutex_unlock(&dev->writer_mutex);
+		errno = ENOMEM;
+		return -1;
+	}
+
+	if (rpt == *r) {
+		STATS_ADD(dev, writes_replaced, 1);
+	}
+	else {
+		rpt->next = NULL;
+		*r = rpt;
+	}
+	memcpy(rpt->data, data, length);
+	rpt->length = length;
+
+	pthread_cond_signal(&dev->writer_condition);
+	pthread_mutex_unlock(&dev->writer_mutex);
+
+	return length;
+}
+
+/* Stop writer_thread(), dropping the reports it has not sent yet. */
+static void writer_stop(hid_device *dev)
+{
+	struct pending_report *lists[2];
+	int i;
+
+	pthread_mutex_lock(&dev->writer_mutex);
+	dev->writer_shutdown = 1;
+	pthread_cond_signal(&dev->writer_condition);
+	pthread_mutex_unlock(&dev->writer_mutex);
+	if (dev->writer_started)
+		pthread_join(dev->writer, NULL);
+
+	lists[0] = dev->pending_reports;
+	lists[1] = dev->free_reports;
+	for (i = 0; i < 2; i++) {
+		while (lists[i]) {
+			struct pending_report *next = lists[i]->next;
+			free(lists[i]->data);
+			free(lists[i]);
+			lists[i] = next;
+		}
+	}
+
+	pthread_cond_destroy(&dev->writer_condition);
+	pthread_mutex_destroy(&dev->writer_mutex);
+}
+
+/* Whether there is a report in the ring. */
+static int have_data(hid_device *dev)
+{
+	return __atomic_load_n(&dev->head, __ATOMIC_SEQ_CST) !=
+	       __atomic_load_n(&dev->tail, __ATOMIC_ACQUIRE);
+}
+
+/* Make ichan unreadable if the ring is empty now. Like signal_events(),
+   this only makes a system call when the ring has become empty. */
+static void clear_events(hid_device *dev)
+{
+	char buf[MAX_QUEUE_LEN];
+
+	if (have_data(dev) ||
+	    !__atomic_exchange_n(&dev->signalled, 0, __ATOMIC_SEQ_CST))
+		return;
+
+	while (read(dev->ichan[0], buf, sizeof(buf)) > 0)
+		;
+
+	/* read_callback() may have queued a report meanwhile, and its
+	   write may just have been drained. */
+	if (have_data(dev)) {
+		__atomic_store_n(&dev->signalled, 1, __ATOMIC_SEQ_CST);
+		write_event(dev);
+	}
+}
+
+/* Resubmit transfers which were parked or whose report was handled
+   outside read_callback(). */
+static void resubmit_transfers(hid_device *dev, struct libusb_transfer **transfers, int count)
+{
+	int i;
+
+	for (i = 0; i < count; i++) {
+		if (dev->shutdown_thread || libusb_submit_transfer(transfers[i]) != 0)
+			transfer_done(dev);
+	}
+}
+
+/* Move parked transfers into the ring as far as there is room now, and
+   resubmit them. Call with mutex locked, returns with it unlocked. */
+static void unpark_transfers(hid_device *dev)
+{
+	struct libusb_transfer *transfers[MAX_INPUT_TRANSFERS];
+	int count = 0;
+	int i;
+
+	while (count < dev->num_parked &&
+	       dev->head - dev->tail < dev->queue_capacity) {
+		struct libusb_transfer *transfer = dev->parked[count];
+		store_report(dev, dev->head, dev->tail, transfer->buffer,
+			transfer->actual_length, dev->parked_timestamps[count]);
+		transfers[count++] = transfer;
+	}
+	for (i = count; i < dev->num_parked; i++) {
+		dev->parked[i - count] = dev->parked[i];
+		dev->parked_timestamps[i - count] = dev->parked_timestamps[i];
+	}
+	dev->num_parked -= count;
+	pthread_mutex_unlock(&dev->mutex);
+
+	resubmit_transfers(dev, transfers, count);
+}
+
+/* Copy the oldest queued report into data and take it off the ring,
+   without clearing ichan. Returns -1 if the ring is empty. */
+static int pop_report(hid_device *dev, unsigned char *data, size_t length, uint64_t *timestamp)
+{
+	const int locked = queue_locked(dev);
+	unsigned int tail;
+	struct input_report *rpt;
+	uint64_t ts, latency;
+	size_t len;
+
+	if (locked)
+		pthread_mutex_lock(&dev->mutex);
+
+	tail = __atomic_load_n(&dev->tail, __ATOMIC_ACQUIRE);
+	do {
+		if (tail == __atomic_load_n(&dev->head, __ATOMIC_ACQUIRE)) {
+			if (locked)
+				pthread_mutex_unlock(&dev->mutex);
+			return -1;
+		}
+		rpt = &dev->input_reports[tail % dev->queue_capacity];
+		len = (length < rpt->len)? length: rpt->len;
+		memcpy(data, rpt->data, len);
+		ts = rpt->timestamp;
+		/* If read_callback() dropped the report meanwhile, the slot
+		   may have been overwritten: try again with the next one. */
+	} while (!__atomic_compare_exchange_n(&dev->tail, &tail, tail + 1, 0,
+			__ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
+
+	if (locked)
+		unpark_transfers(dev);
+
+	if (timestamp)
+		*timestamp = ts;
+	latency = monotonic_ns() - ts;
+	histogram_record(dev, HID_HISTOGRAM_QUEUE_LATENCY, latency);
+	HID_PROBE3(queue_dequeue, dev, __atomic_load_n(&dev->head, __ATOMIC_RELAXED) - tail - 1, latency);
+
+	return len;
+}
+
+/* Helper function, to simplify hid_read(). */
+static int return_data(hid_device *dev, unsigned char *data, size_t length, uint64_t *timestamp)
+{
+	int len = pop_report(dev, data, length, timestamp);
+
+	clear_events(dev);
+	return (len < 0)? 0: len;
+}
+
+/* Same as return_data(), for up to max_reports reports at once. */
+static int return_data_batch(hid_device *dev, unsigned char *data, size_t stride, int max_reports, int *lengths)
+{
+	int num_reports = 0;
+
+	while (num_reports < max_reports) {
+		int len = pop_report(dev, data + num_reports * stride, stride, NULL);
+		if (len < 0)
+			break;
+		lengths[num_reports++] = len;
+	}
+	clear_events(dev);
+
+	return num_reports;
+}
+
+static void cleanup_wait(void *param)
+{
+	hid_device *dev = param;
+	__atomic_sub_fetch(&dev->num_waiting, 1, __ATOMIC_SEQ_CST);
+	pthread_mutex_unlock(&dev->mutex);
+}
+
+
+/* Wait until there is a report in the ring. Returns 1 if there is one,
+   0 on timeout and -1 on error or if the device has gone away. The
+   mutex is only taken when the ring is empty and milliseconds != 0. */
+static int wait_for_data(hid_device *dev, int milliseconds)
+{
+	struct timespec ts;
+	int res = 0;
+
+	/* There's an input report queued up. */
+	if (have_data(dev))
+		return 1;
+
+	if (dev->shutdown_thread) {
+		/* This means the device has been disconnected.
+		   An error code of -1 should be returned. */
+		return -1;
+	}
+
+	/* Purely non-blocking */
+	if (milliseconds == 0)
+		return 0;
+
+	if (milliseconds > 0) {
+		/* Non-blocking, but called with timeout. */
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_sec += milliseconds / 1000;
+		ts.tv_nsec += (milliseconds % 1000) * 1000000;
+		if (ts.tv_nsec >= 1000000000L) {
+			ts.tv_sec++;
+			ts.tv_nsec -= 1000000000L;
+		}
+	}
+
+	/* read_callback() only signals the condition when num_waiting is
+	   set, so set it before looking at the ring again. */
+	pthread_mutex_lock(&dev->mutex);
+	__atomic_add_fetch(&dev->num_waiting, 1, __ATOMIC_SEQ_CST);
+	pthread_cleanup_push(&cleanup_wait, dev);
+
+	while (!have_data(dev) && !dev->shutdown_thread) {
+		if (milliseconds == -1)
+			res = pthread_cond_wait(&dev->condition, &dev->mutex);
+		else
+			res = pthread_cond_timedwait(&dev->condition, &dev->mutex, &ts);
+
+		/* On res == 0 there was a report, a spurious wake up or the
+		   device was shut down: run the loop again. */
+		if (res != 0)
+			break;
+	}
+
+	pthread_cleanup_pop(1);
+
+	if (have_data(dev))
+		return 1;
+	return (res == ETIMEDOUT)? 0: -1;
+}
+
+int HID_API_EXPORT hid_read_timestamped(hid_device *dev, unsigned char *data, size_t length, uint64_t *timestamp, int milliseconds)
+{
+	int bytes_read;
+
+	STATS_ADD(dev, read_calls, 1);
+
+#if 0
+	int transferred;
+	int res = libusb_interrupt_transfer(dev->device_handle, dev->input_endpoint, data, length, &transferred, 5000);
+	LOG("transferred: %d\n", transferred);
+	return transferred;
+#endif
+
+	bytes_read = wait_for_data(dev, milliseconds);
+	if (bytes_read > 0)
+		bytes_read = return_data(dev, data, length, timestamp);
+
+	return bytes_read;
+}
+
+int HID_API_EXPORT hid_read_timeout(hid_device *dev, unsigned char *data, size_t length, int milliseconds)
+{
+	return hid_read_timestamped(dev, data, length, NULL, milliseconds);
+}
+
+int HID_API_EXPORT hid_read_batch(hid_device *dev, unsigned char *data, size_t stride, int max_reports, int *lengths, int milliseconds)
+{
+	int num_reports;
+
+	if (max_reports <= 0)
+		return 0;
+
+	STATS_ADD(dev, read_calls, 1);
+
+	num_reports = wait_for_data(dev, milliseconds);
+	if (num_reports > 0)
+		num_reports = return_data_batch(dev, data, stride, max_reports, lengths);
+
+	return num_reports;
+}
+
+int HID_API_EXPORT hid_read(hid_device *dev, unsigned char *data, size_t length)
+{
+	return hid_read_timeout(dev, data, length, dev->blocking ? -1 : 0);
+}
+
+int HID_API_EXPORT hid_set_nonblocking(hid_device *dev, int nonblock)
+{
+	dev->blocking = !nonblock;
+
+	return 0;
+}
+
+// return an event handle that can be used for poll/epoll/select etc
+hid_handle_t HID_API_EXPORT hid_get_event_handle(hid_device *dev)
+{
+    return (hid_handle_t) ((intptr_t)dev->ichan[0]);
+}
+
+int HID_API_EXPORT hid_get_stats(hid_device *dev, struct hid_device_stats *stats)
+{
+	stats->reports_received = __atomic_load_n(&dev->stats.reports_received, __ATOMIC_RELAXED);
+	stats->bytes_received = __atomic_load_n(&dev->stats.bytes_received, __ATOMIC_RELAXED);
+	stats->reports_dropped = __atomic_load_n(&dev->stats.reports_dropped, __ATOMIC_RELAXED);
+	stats->max_queue_depth = __atomic_load_n(&dev->stats.max_queue_depth, __ATOMIC_RELAXED);
+	stats->read_calls = __atomic_load_n(&dev->stats.read_calls, __ATOMIC_RELAXED);
+	stats->writes = __atomic_load_n(&dev->stats.writes, __ATOMIC_RELAXED);
+	stats->write_time_ns = __atomic_load_n(&dev->stats.write_time_ns, __ATOMIC_RELAXED);
+	stats->max_write_time_ns = __atomic_load_n(&dev->stats.max_write_time_ns, __ATOMIC_RELAXED);
+	stats->reports_parsed = __atomic_load_n(&dev->stats.reports_parsed, __ATOMIC_RELAXED);
+	stats->parse_time_ns = __atomic_load_n(&dev->stats.parse_time_ns, __ATOMIC_RELAXED);
+	stats->writes_replaced = __atomic_load_n(&dev->stats.writes_replaced, __ATOMIC_RELAXED);
+	stats->reports_coalesced = __atomic_load_n(&dev->stats.reports_coalesced, __ATOMIC_RELAXED);
+
+	return 0;
+}
+
+void HID_API_EXPORT hid_stats_add_parse_time(hid_device *dev, uint64_t nanoseconds)
+{
+	STATS_ADD(dev, reports_parsed, 1);
+	STATS_ADD(dev, parse_time_ns, nanoseconds);
+	histogram_record(dev, HID_HISTOGRAM_PARSE, nanoseconds);
+}
+
+int HID_API_EXPORT hid_set_parse_timing(hid_device *dev, int enable)
+{
+	__atomic_store_n(&dev->parse_timing, enable != 0, __ATOMIC_RELAXED);
+	return 0;
+}
+
+int HID_API_EXPORT hid_get_parse_timing(hid_device *dev)
+{
+	return __atomic_load_n(&dev->parse_timing, __ATOMIC_RELAXED) ||
+		__atomic_load_n(&dev->histograms_enabled, __ATOMIC_RELAXED);
+}
+
+int HID_API_EXPORT hid_set_histograms(hid_device *dev, int enable)
+{
+	if (enable && !dev->histograms) {
+		dev->histograms = calloc(HID_HISTOGRAM_COUNT, sizeof(struct hid_histogram));
+		if (!dev->histograms)
+			return -1;
+	}
+	__atomic_store_n(&dev->histograms_enabled, enable != 0, __ATOMIC_RELEASE);
+	return 0;
+}
+
+int HID_API_EXPORT hid_get_histogram(hid_device *dev, int type, struct hid_histogram *histogram)
+{
+	struct hid_histogram *h;
+	int i;
+
+	if (type < 0 || type >= HID_HISTOGRAM_COUNT || !dev->histograms)
+		return -1;
+
+	h = dev->histograms + type;
+	histogram->count = __atomic_load_n(&h->count, __ATOMIC_RELAXED);
+	for (i = 0; i < HID_HISTOGRAM_BUCKETS; i++)
+		histogram->buckets[i] = __atomic_load_n(&h->buckets[i], __ATOMIC_RELAXED);
+
+	return 0;
+}
+
+uint64_t HID_API_EXPORT hid_histogram_bucket_start(int bucket)
+{
+	if (bucket < 4)
+		return (bucket < 0)? 0: bucket;
+	if (bucket >= HID_HISTOGRAM_BUCKETS)
+		return UINT64_MAX;
+	return (uint64_t)(4 + bucket % 4) << (bucket / 4 - 1);
+}
+
+int HID_API_EXPORT hid_set_enumeration_cache(int enable)
+{
+	/* The cache follows the udev hidraw nodes. libusb devices are
+	   kept in device_cache already. */
+	errno = ENOTSUP;
+	return -1;
+}
+
+int HID_API_EXPORT hid_set_enumeration_sysfs(int enable)
+{
+	/* libusb enumerates through usbfs/sysfs on its own. */
+	errno = ENOTSUP;
+	return -1;
+}
+
+int HID_API_EXPORT hid_set_input_transfers(int count)
+{
+	if (count < 1 || count > MAX_INPUT_TRANSFERS)
+		return -1;
+	num_input_transfers = count;
+	return 0;
+}
+
+int HID_API_EXPORT hid_set_input_report_callback(hid_device *dev, hid_input_report_callback callback, void *user_data, int queue_reports)
+{
+	/* read_callback() takes no lock. Unhook the old callback first,
+	   and wait until a call to it which is already under way has
+	   returned, so the caller may free its user_data once we return.
+	   Unless we are called from that very callback. */
+	__atomic_store_n(&dev->input_callback, NULL, __ATOMIC_SEQ_CST);
+	if (!events_on_thread()) {
+		while (__atomic_load_n(&dev->delivering, __ATOMIC_SEQ_CST))
+			sched_yield();
+	}
+
+	dev->input_callback_data = user_data;
+	dev->queue_reports = queue_reports;
+	__atomic_store_n(&dev->input_callback, callback, __ATOMIC_SEQ_CST);
+
+	return 0;
+}
+
+int HID_API_EXPORT hid_set_input_queue(hid_device *dev, int capacity, enum hid_queue_policy policy, hid_queue_overflow_callback callback, void *user_data)
+{
+	struct libusb_transfer *transfers[MAX_INPUT_TRANSFERS];
+	struct input_report *reports, *old_reports;
+	uint8_t *report_data, *old_data;
+	unsigned int count = 0;
+	unsigned int head, tail;
+	int num_parked;
+	int i;
+
+	if (capacity < 1 || capacity > MAX_QUEUE_CAPACITY ||
+	    (capacity & (capacity - 1)) != 0)
+		return -1;
+	if (policy < HID_QUEUE_DROP_OLDEST || policy > HID_QUEUE_BLOCK)
+		return -1;
+	if (alloc_ring(capacity, dev->input_ep_max_packet_size, &reports, &report_data) < 0)
+		return -1;
+
+	/* Keep read_callback() out of the ring, like in
+	   hid_set_input_report_callback(). */
+	__atomic_store_n(&dev->queue_paused, 1, __ATOMIC_SEQ_CST);
+	if (!events_on_thread()) {
+		while (__atomic_load_n(&dev->delivering, __ATOMIC_SEQ_CST))
+			sched_yield();
+	}
+
+	/* Move over the newest reports which fit, then the parked ones. */
+	pthread_mutex_lock(&dev->mutex);
+	head = dev->head;
+	tail = dev->tail;
+	if (head - tail > (unsigned int)capacity) {
+		STATS_ADD(dev, reports_dropped, head - tail - capacity);
+		tail = head - capacity;
+	}
+	for (; tail != head; tail++, count++) {
+		struct input_report *rpt = &dev->input_reports[tail % dev->queue_capacity];
+		memcpy(reports[count].data, rpt->data, rpt->len);
+		reports[count].len = rpt->len;
+		reports[count].timestamp = rpt->timestamp;
+	}
+	num_parked = dev->num_parked;
+	for (i = 0; i < num_parked; i++) {
+		struct libusb_transfer *transfer = dev->parked[i];
+		if (count < (unsigned int)capacity) {
+			memcpy(reports[count].data, transfer->buffer, transfer->actual_length);
+			reports[count].len = transfer->actual_length;
+			reports[count].timestamp = dev->parked_timestamps[i];
+			count++;
+		}
+		else {
+			STATS_ADD(dev, reports_dropped, 1);
+		}
+		transfers[i] = transfer;
+	}
+	dev->num_parked = 0;
+
+	old_reports = dev->input_reports;
+	old_data = dev->report_data;
+	dev->input_reports = reports;
+	dev->report_data = report_data;
+	dev->queue_capacity = capacity;
+	__atomic_store_n(&dev->tail, 0, __ATOMIC_SEQ_CST);
+	__atomic_store_n(&dev->head, count, __ATOMIC_SEQ_CST);
+	dev->queue_policy = policy;
+	dev->overflow_callback = callback;
+	dev->overflow_callback_data = user_data;
+	pthread_mutex_unlock(&dev->mutex);
+
+	free(old_reports);
+	free(old_data);
+	resubmit_transfers(dev, transfers, num_parked);
+
+	__atomic_store_n(&dev->queue_paused, 0, __ATOMIC_SEQ_CST);
+	if (have_data(dev))
+		signal_events(dev);
+
+	return 0;
+}
+
+
+/* Called by libusb on whichever thread handles events. Only queues the
+   event, hid_hotplug_handle_events() does the rest. */
+static int LIBUSB_CALL hotplug_libusb_callback(libusb_context *ctx, libusb_device *device, libusb_hotplug_event event, void *user_data)
+{
+	struct hotplug_event *ev = malloc(sizeof(struct hotplug_event));
+
+	if (!ev) {
+		LOG("hotplug event dropped, out of memory\n");
+		return 0;
+	}
+	ev->device = libusb_ref_device(device);
+	ev->event = event;
+	ev->next = NULL;
+
+	pthread_mutex_lock(&hotplug.mutex);
+	*hotplug.last_event = ev;
+	hotplug.last_event = &ev->next;
+	pthread_mutex_unlock(&hotplug.mutex);
+
+	/* A full pipe is readable already. */
+	if (write(hotplug.pipe[1], "!", 1) < 1 && errno != EAGAIN)
+		LOG("write failed %s\n", strerror(errno));
+
+	return 0;
+}
+
+static int hotplug_match(struct hotplug_callback *cb, struct hid_device_info *info, hid_hotplug_event event)
+{
+	return !cb->removed && (cb->events & event) &&
+		(cb->vendor_id == 0x0 || cb->vendor_id == info->vendor_id) &&
+		(cb->product_id == 0x0 || cb->product_id == info->product_id) &&
+		(cb->usage_page == 0x0 || cb->usage_page == info->usage_page) &&
+		(cb->usage == 0x0 || cb->usage == info->usage);
+}
+
+/* Call the callbacks which match. If only is not NULL, no other
+   callback is considered. */
+static void hotplug_notify(struct hotplug_callback *only, struct hid_device_info *info, hid_hotplug_event event)
+{
+	struct hotplug_callback *cb;
+
+	/* Callbacks which deregister themselves are only marked as removed
+	   until the outermost call is done. */
+	hotplug.running++;
+	for (cb = hotplug.callbacks; cb; cb = cb->next) {
+		if ((!only || cb == only) && hotplug_match(cb, info, event))
+			cb->callback(cb->handle, info, event, cb->user_data);
+	}
+	hotplug.running--;
+
+	if (!hotplug.running) {
+		struct hotplug_callback **c = &hotplug.callbacks;
+		while (*c) {
+			struct hotplug_callback *gone = *c;
+			if (!gone->removed) {
+				c = &gone->next;
+				continue;
+			}
+			*c = gone->next;
+			free(gone);
+		}
+	}
+}
+
+static void hotplug_device_add(libusb_device *device)
+{
+	struct hotplug_device **d = &hotplug.devices;
+	struct hid_device_info *info;
+
+	/* One record per HID interface. */
+	info = create_device_info(device, 0, 0);
+
+	while (*d)
+		d = &(*d)->next;
+	while (info) {
+		struct hid_device_info *next = info->next;
+
+		*d = malloc(sizeof(struct hotplug_device));
+		if (!*d) {
+			LOG("hotplug event dropped, out of memory\n");
+			hid_free_enumeration(info);
+			return;
+		}
+		info->next = NULL;
+		(*d)->device = libusb_ref_device(device);
+		(*d)->info = info;
+		(*d)->next = NULL;
+		d = &(*d)->next;
+
+		hotplug_notify(NULL, info, HID_HOTPLUG_EVENT_DEVICE_ARRIVED);
+		info = next;
+	}
+}
+
+static void hotplug_device_remove(libusb_device *device)
+{
+	struct hotplug_device **d = &hotplug.devices;
+
+	while (*d) {
+		struct hotplug_device *gone = *d;
+		if (gone->device != device) {
+			d = &gone->next;
+			continue;
+		}
+		*d = gone->next;
+		hotplug_notify(NULL, gone->info, HID_HOTPLUG_EVENT_DEVICE_LEFT);
+		hid_free_enumeration(gone->info);
+		libusb_unref_device(gone->device);
+		free(gone);
+	}
+}
+
+/* Work off the events queued by hotplug_libusb_callback(). */
+static int hotplug_process_events(void)
+{
+	char buf[64];
+	int handled = 0;
+
+	while (read(hotplug.pipe[0], buf, sizeof(buf)) > 0)
+		;
+
+	for (;;) {
+		struct hotplug_event *ev;
+
+		pthread_mutex_lock(&hotplug.mutex);
+		ev = hotplug.events;
+		if (ev) {
+			hotplug.events = ev->next;
+			if (!hotplug.events)
+				hotplug.last_event = &hotplug.events;
+		}
+		pthread_mutex_unlock(&hotplug.mutex);
+
+		if (!ev)
+			break;
+
+		if (ev->event == LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED)
+			hotplug_device_add(ev->device);
+		else
+			hotplug_device_remove(ev->device);
+		handled++;
+
+		libusb_unref_device(ev->device);
+		free(ev);
+	}
+
+	return handled;
+}
+
+static void hotplug_stop(void)
+{
+	if (!hotplug.started)
+		return;
+
+	libusb_hotplug_deregister_callback(usb_context, hotplug.libusb_handle);
+	events_unref();
+
+	while (hotplug.callbacks) {
+		struct hotplug_callback *next = hotplug.callbacks->next;
+		free(hotplug.callbacks);
+		hotplug.callbacks = next;
+	}
+	/* Nobody is registered any more, so this only frees the events. */
+	hotplug_process_events();
+	while (hotplug.devices) {
+		struct hotplug_device *next = hotplug.devices->next;
+		hid_free_enumeration(hotplug.devices->info);
+		libusb_unref_device(hotplug.devices->device);
+		free(hotplug.devices);
+		hotplug.devices = next;
+	}
+
+	close(hotplug.pipe[0]);
+	close(hotplug.pipe[1]);
+	hotplug.started = 0;
+}
+
+static int hotplug_start(void)
+{
+	int res;
+
+	if (!libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG)) {
+		errno = ENOTSUP;
+		return -1;
+	}
+
+	if (pipe(hotplug.pipe) < 0)
+		return -1;
+	fcntl(hotplug.pipe[0], F_SETFL, O_NONBLOCK);
+	fcntl(hotplug.pipe[1], F_SETFL, O_NONBLOCK);
+	hotplug.last_event = &hotplug.events;
+
+	/* With LIBUSB_HOTPLUG_ENUMERATE, the connected devices are queued
+	   as arrivals right away. */
+	res = libusb_hotplug_register_callback(usb_context,
+		LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED | LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT,
+		LIBUSB_HOTPLUG_ENUMERATE,
+		LIBUSB_HOTPLUG_MATCH_ANY, LIBUSB_HOTPLUG_MATCH_ANY, LIBUSB_HOTPLUG_MATCH_ANY,
+		hotplug_libusb_callback, NULL, &hotplug.libusb_handle);
+	if (res != LIBUSB_SUCCESS) {
+		close(hotplug.pipe[0]);
+		close(hotplug.pipe[1]);
+		return -1;
+	}
+
+	/* Hotplug callbacks only run while libusb handles events, with no
+	   device open that is for hotplug alone. */
+	if (events_ref() < 0) {
+		libusb_hotplug_deregister_callback(usb_context, hotplug.libusb_handle);
+		close(hotplug.pipe[0]);
+		close(hotplug.pipe[1]);
+		return -1;
+	}
+	hotplug.started = 1;
+
+	/* Nobody is registered yet, so this only records what is
+	   connected. */
+	hotplug_process_events();
+
+	return 0;
+}
+
+/* Stop listening once the last callback is gone, so that
+   hid_hotplug_get_fd() returns -1 again. Not while callbacks run, they
+   are only marked as removed then. */
+static void hotplug_stop_unused(void)
+{
+	if (!hotplug.running && !hotplug.callbacks &&
+	    !events_on_thread())
+		hotplug_stop();
+}
+
+int HID_API_EXPORT hid_hotplug_register(unsigned short vendor_id, unsigned short product_id, unsigned short usage_page, unsigned short usage, int events, int flags, hid_hotplug_callback callback, void *user_data, hid_hotplug_handle *handle)
+{
+	struct hotplug_callback *cb, **c;
+
+	if (!callback || !(events & (HID_HOTPLUG_EVENT_DEVICE_ARRIVED | HID_HOTPLUG_EVENT_DEVICE_LEFT))) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (hid_init() < 0)
+		return -1;
+
+	if (!hotplug.started && hotplug_start() < 0)
+		return -1;
+
+	cb = calloc(1, sizeof(struct hotplug_callback));
+	if (!cb) {
+		hotplug_stop_unused();
+		return -1;
+	}
+	cb->handle = ++hotplug.next_handle;
+	cb->vendor_id = vendor_id;
+	cb->product_id = product_id;
+	cb->usage_page = usage_page;
+	cb->usage = usage;
+	cb->events = events;
+	cb->callback = callback;
+	cb->user_data = user_data;
+
+	for (c = &hotplug.callbacks; *c; c = &(*c)->next)
+		;
+	*c = cb;
+
+	if (handle)
+		*handle = cb->handle;
+
+	if (flags & HID_HOTPLUG_ENUMERATE) {
+		struct hotplug_device *d;
+		for (d = hotplug.devices; d; d = d->next)
+			hotplug_notify(cb, d->info, HID_HOTPLUG_EVENT_DEVICE_ARRIVED);
+	}
+
+	/* The callback may have deregistered itself. */
+	hotplug_stop_unused();
+
+	return 0;
+}
+
+int HID_API_EXPORT hid_hotplug_deregister(hid_hotplug_handle handle)
+{
+	struct hotplug_callback **c;
+
+	for (c = &hotplug.callbacks; *c; c = &(*c)->next) {
+		struct hotplug_callback *cb = *c;
+		if (cb->handle != handle || cb->removed)
+			continue;
+
+		if (hotplug.running) {
+			/* Freed by hotplug_notify(). */
+			cb->removed = 1;
+		}
+		else {
+			*c = cb->next;
+			free(cb);
+			hotplug_stop_unused();
+		}
+		return 0;
+	}
+
+	errno = ENOENT;
+	return -1;
+}
+
+int HID_API_EXPORT hid_hotplug_get_fd(void)
+{
+	return hotplug.started? hotplug.pipe[0]: -1;
+}
+
+int HID_API_EXPORT hid_hotplug_handle_events(void)
+{
+	int handled;
+
+	if (!hotplug.started) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	handled = hotplug_process_events();
+
+	/* The callbacks may have deregistered themselves. */
+	hotplug_stop_unused();
+
+	return handled;
+}
+
+/* The reactor waits on the hidraw file descriptors, libusb devices have
+   none of their own. */
+hid_reactor * HID_API_EXPORT hid_reactor_new(void)
+{
+	errno = ENOTSUP;
+	return NULL;
+}
+
+hid_reactor * HID_API_EXPORT hid_reactor_new_io_uring(void)
+{
+	return hid_reactor_new();
+}
+
+void HID_API_EXPORT hid_reactor_free(hid_reactor *reactor)
+{
+}
+
+int HID_API_EXPORT hid_reactor_add(hid_reactor *reactor, hid_device *dev)
+{
+	errno = ENOTSUP;
+	return -1;
+}
+
+int HID_API_EXPORT hid_reactor_remove(hid_reactor *reactor, hid_device *dev)
+{
+	errno = ENOTSUP;
+	return -1;
+}
+
+int HID_API_EXPORT hid_reactor_wait(hid_reactor *reactor, hid_device **ready, int max_ready, int milliseconds)
+{
+	errno = ENOTSUP;
+	return -1;
+}
+
+int HID_API_EXPORT hid_reactor_dispatch(hid_reactor *reactor, int milliseconds)
+{
+	errno = ENOTSUP;
+	return -1;
+}
+
+int HID_API_EXPORT hid_send_feature_report(hid_device *dev, const unsigned char *data, size_t length)
+{
+	int res = -1;
+	int skipped_report_id = 0;
+	int report_number = data[0];
+
+	if (report_number == 0x0) {
+		data++;
+		length--;
+		skipped_report_id = 1;
+	}
+
+	res = libusb_control_transfer(dev->device_handle,
+		LIBUSB_REQUEST_TYPE_CLASS|LIBUSB_RECIPIENT_INTERFACE|LIBUSB_ENDPOINT_OUT,
+		0x09/*HID set_report*/,
+		(3/*HID feature*/ << 8) | report_number,
+		dev->interface,
+		(unsigned char *)data, length,
+		1000/*timeout millis*/);
+
+	if (res < 0)
+		return -1;
+
+	/* Account for the report ID */
+	if (skipped_report_id)
+		length++;
 
 	return length;
 }
@@ -1290,19 +2965,63 @@ int HID_API_EXPORT hid_get_feature_report(hid_device *dev, unsigned char *data,
 
 void HID_API_EXPORT hid_close(hid_device *dev)
 {
+	int num_parked;
+	int i;
+
 	if (!dev)
 		return;
 
-	/* Cause read_thread() to stop. */
+	/* Closing waits for the transfers to be cancelled and for
+	   event_thread() to end, so it would never return when called
+	   from a callback. See hid_close() in hidapi.h. */
+	if (events_on_thread()) {
+		LOG("hid_close() called from a callback, the device stays open\n");
+		errno = EDEADLK;
+		return;
+	}
+
+	writer_stop(dev);
+
+	/* Cancel any transfer that may be pending. This call will fail
+	   if no transfers are pending, but that's OK. */
 	dev->shutdown_thread = 1;
-	libusb_cancel_transfer(dev->transfer);
+	for (i = 0; i < dev->num_transfers; i++)
+		libusb_cancel_transfer(dev->transfers[i]);
+
+	/* Parked transfers are not submitted, nothing will complete them.
+	   read_callback() parks no more once shutdown_thread is set. */
+	pthread_mutex_lock(&dev->mutex);
+	num_parked = dev->num_parked;
+	dev->num_parked = 0;
+	pthread_mutex_unlock(&dev->mutex);
+	for (i = 0; i < num_parked; i++)
+		transfer_done(dev);
+	for (i = 0; i < MAX_WRITE_TRANSFERS; i++) {
+		if (__atomic_load_n(&dev->writes_busy, __ATOMIC_ACQUIRE) & (1u << i))
+			libusb_cancel_transfer(dev->writes[i].transfer);
+	}
 
-	/* Wait for read_thread() to end. */
-	pthread_join(dev->thread, NULL);
+	/* Wait for the cancellations to complete. */
+	while (!dev->cancelled)
+		libusb_handle_events_completed(usb_context, &dev->cancelled);
+	while (__atomic_load_n(&dev->writes_busy, __ATOMIC_ACQUIRE) ||
+	       __atomic_load_n(&dev->write_callbacks, __ATOMIC_ACQUIRE)) {
+		struct timeval tv = { 0, 100000 };
+		libusb_handle_events_timeout_completed(usb_context, &tv, NULL);
+	}
+	events_unref();
 
-	/* Clean up the Transfer objects allocated in read_thread(). */
-	free(dev->transfer->buffer);
-	libusb_free_transfer(dev->transfer);
+	/* Clean up the Transfer objects allocated in start_input(). */
+	for (i = 0; i < dev->num_transfers; i++) {
+		free(dev->transfers[i]->buffer);
+		libusb_free_transfer(dev->transfers[i]);
+	}
+	for (i = 0; i < MAX_WRITE_TRANSFERS; i++) {
+		if (dev->writes[i].transfer) {
+			free(dev->writes[i].transfer->buffer);
+			libusb_free_transfer(dev->writes[i].transfer);
+		}
+	}
 
 	/* release the interface */
 	libusb_release_interface(dev->device_handle, dev->interface);
@@ -1310,13 +3029,6 @@ void HID_API_EXPORT hid_close(hid_device *dev)
 	/* Close the handle */
 	libusb_close(dev->device_handle);
 
-	/* Clear out the queue of received reports. */
-	pthread_mutex_lock(&dev->mutex);
-	while (dev->input_reports) {
-		drop_data(dev);
-	}
-	pthread_mutex_unlock(&dev->mutex);
-
 	free_hid_device(dev);
 }
 
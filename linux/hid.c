@@ -27,6 +27,7 @@
 #include <stdlib.h>
 #include <locale.h>
 #include <errno.h>
+#include <time.h>
 
 /* Unix */
 #include <unistd.h>
@@ -35,15 +36,27 @@
 #include <sys/ioctl.h>
 #include <sys/utsname.h>
 #include <fcntl.h>
+#include <dirent.h>
+#include <limits.h>
 #include <poll.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#ifdef HAVE_IO_URING
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#endif
 
 /* Linux */
 #include <linux/hidraw.h>
 #include <linux/version.h>
 #include <linux/input.h>
 #include <libudev.h>
+#ifdef HAVE_IO_URING
+#include <linux/io_uring.h>
+#endif
 
 #include "hidapi.h"
+#include "hidapi_probes.h"
 
 /* Definitions from linux/hidraw.h. Since these are new, some distros
    may not have header files which contain them. */
@@ -71,15 +84,155 @@ enum device_string_id {
 	DEVICE_STRING_COUNT,
 };
 
+/* Maximum number of ready devices handled by one epoll_wait() in
+   hid_reactor_dispatch(). */
+#define REACTOR_MAX_EVENTS 64
+/* Size of the buffer hid_reactor_dispatch() reads reports into. */
+#define REACTOR_REPORT_SIZE 4096
+
+/* Maximum number of top-level collections (records) per hidraw node. */
+#define MAX_TOP_LEVEL_USAGES 16
+
+/* Receive buffer of the udev monitors, so a burst of hotplug events
+   doesn't overflow it. */
+#define MONITOR_BUFFER_SIZE (1024 * 1024)
+
+#ifdef HAVE_IO_URING
+/* Submission queue size of an io_uring reactor. Every device has a
+   poll and a read in flight, but those don't take up queue entries. */
+#define URING_ENTRIES 256
+
+/* A device in an io_uring reactor, and the buffer its read goes into. */
+struct uring_slot {
+	hid_device *dev;
+	int removed; /* waiting for the cancelled read to complete */
+	struct uring_slot *next;
+	unsigned char buf[REACTOR_REPORT_SIZE];
+};
+
+/* The mmap()ed rings of an io_uring instance. */
+struct uring {
+	int fd;
+	unsigned sq_entries;
+	unsigned sq_mask;
+	unsigned *sq_head;
+	unsigned *sq_tail;
+	unsigned *sq_array;
+	unsigned sqe_tail; /* queued locally, not yet seen by the kernel */
+	struct io_uring_sqe *sqes;
+	unsigned cq_mask;
+	unsigned *cq_head;
+	unsigned *cq_tail;
+	struct io_uring_cqe *cqes;
+	void *sq_ring;
+	size_t sq_ring_size;
+	void *cq_ring;
+	size_t cq_ring_size; /* 0 if it shares the sq_ring mapping */
+	size_t sqes_size;
+};
+#endif
+
+struct hid_reactor_ {
+	int epoll_fd;
+	unsigned char buf[REACTOR_REPORT_SIZE];
+	int use_uring; /* boolean */
+#ifdef HAVE_IO_URING
+	struct uring ring;
+	struct uring_slot *slots;
+	__u64 timeout_tag; /* user_data of the pending TIMEOUT, 0 if none */
+	unsigned timeouts;
+#endif
+};
+
+/* A hidraw node known to the enumeration cache. */
+struct enum_cache_entry {
+	char *syspath;
+	struct hid_device_info *info; /* one record per top-level collection */
+	struct enum_cache_entry *next;
+};
+
+/* See hid_set_enumeration_cache(). The cache is on while monitor is
+   set. */
+static struct {
+	pthread_mutex_t mutex;
+	struct udev *udev;
+	struct udev_monitor *monitor;
+	struct enum_cache_entry *entries;
+	struct enum_cache_entry **tail;
+} enum_cache = { PTHREAD_MUTEX_INITIALIZER, NULL, NULL, NULL, &enum_cache.entries };
+
+/* See hid_set_enumeration_sysfs(). */
+static int enum_sysfs = 0;
+
+/* A registered hotplug callback, see hid_hotplug_register(). */
+struct hotplug_callback {
+	hid_hotplug_handle handle;
+	unsigned short vendor_id;
+	unsigned short product_id;
+	unsigned short usage_page;
+	unsigned short usage;
+	int events;
+	hid_hotplug_callback callback;
+	void *user_data;
+	int removed; /* deregistered while the callbacks were running */
+	struct hotplug_callback *next;
+};
+
+/* Hotplug state. Only used from the thread calling the hotplug
+   functions. */
+static struct {
+	struct udev *udev;
+	struct udev_monitor *monitor;
+	struct hotplug_callback *callbacks;
+	struct enum_cache_entry *devices; /* the connected hidraw nodes */
+	hid_hotplug_handle next_handle;
+	int running; /* nesting depth of hotplug_notify() */
+} hotplug;
+
+/* An Output report waiting for writer_thread(), see hid_write_latest(). */
+struct pending_report {
+	struct pending_report *next;
+	size_t length;
+	size_t size; /* of data */
+	unsigned char *data;
+};
+
 struct hid_device_ {
 	int device_handle;
 	int blocking;
 	int uses_numbered_reports;
+
+	/* Input report callback, see hid_set_input_report_callback() */
+	hid_input_report_callback input_callback;
+	void *input_callback_data;
+
+	/* Read once in hid_open_path(), NULL if not available */
+	wchar_t *strings[DEVICE_STRING_COUNT];
+
+	/* See hid_get_stats() */
+	struct hid_device_stats stats;
+	int parse_timing; /* see hid_set_parse_timing() */
+
+	/* See hid_set_histograms(), NULL until they are first enabled */
+	struct hid_histogram *histograms;
+	int histograms_enabled;
+	uint64_t last_report; /* timestamp of the previous Input report */
+
+	/* Writer thread, see hid_write_latest() */
+	pthread_t writer;
+	pthread_mutex_t writer_mutex; /* Protects the fields below */
+	pthread_cond_t writer_condition;
+	int writer_started;
+	int writer_shutdown;
+	struct pending_report *pending_reports; /* at most one per report ID */
+	struct pending_report *free_reports;
 };
 
 
 static __u32 kernel_version = 0;
 
+static void hotplug_stop(void);
+
 static __u32 detect_kernel_version(void)
 {
 	struct utsname name;
@@ -101,12 +254,61 @@ static __u32 detect_kernel_version(void)
 	return 0;
 }
 
+/* CLOCK_MONOTONIC in nanoseconds, for the report timestamps. */
+static uint64_t monotonic_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Relaxed atomic counters, see hid_get_stats(). */
+#define STATS_ADD(dev, field, n) \
+	__atomic_fetch_add(&(dev)->stats.field, (n), __ATOMIC_RELAXED)
+
+static void stats_max(uint64_t *counter, uint64_t value)
+{
+	uint64_t cur = __atomic_load_n(counter, __ATOMIC_RELAXED);
+
+	while (value > cur &&
+	       !__atomic_compare_exchange_n(counter, &cur, value, 1,
+			__ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		;
+}
+
+/* Bucket of a value in a struct hid_histogram: the values below 4 get a
+   bucket each, every larger power of two is split in 4. */
+static int histogram_bucket(uint64_t value)
+{
+	int msb;
+
+	if (value < 4)
+		return value;
+	msb = 63 - __builtin_clzll(value);
+	return 4 * (msb - 1) + ((value >> (msb - 2)) & 3);
+}
+
+/* Count value in one of the histograms, if they are enabled. */
+static void histogram_record(hid_device *dev, int type, uint64_t value)
+{
+	struct hid_histogram *h;
+
+	if (!__atomic_load_n(&dev->histograms_enabled, __ATOMIC_ACQUIRE))
+		return;
+	h = dev->histograms + type;
+	__atomic_fetch_add(&h->count, 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&h->buckets[histogram_bucket(value)], 1, __ATOMIC_RELAXED);
+}
+
 static hid_device *new_hid_device(void)
 {
 	hid_device *dev = calloc(1, sizeof(hid_device));
 	dev->device_handle = -1;
 	dev->blocking = 1;
 	dev->uses_numbered_reports = 0;
+	pthread_mutex_init(&dev->writer_mutex, NULL);
+	pthread_cond_init(&dev->writer_condition, NULL);
 
 	return dev;
 }
@@ -137,6 +339,115 @@ static wchar_t *copy_udev_string(struct udev_device *dev, const char *udev_name)
 	return utf8_to_wchar_t(udev_device_get_sysattr_value(dev, udev_name));
 }
 
+static __u32 get_bytes(__u8 *rpt, size_t len, size_t num_bytes, size_t cur)
+{
+	/* Return if there aren't enough bytes. */
+	if (cur + num_bytes >= len)
+		return 0;
+
+	if (num_bytes == 0)
+		return 0;
+	else if (num_bytes == 1) {
+		return rpt[cur+1];
+	}
+	else if (num_bytes == 2) {
+		return (rpt[cur+2] * 256 + rpt[cur+1]);
+	}
+	else if (num_bytes == 4) {
+		return (rpt[cur+4] * 0x01000000 +
+		        rpt[cur+3] * 0x00010000 +
+		        rpt[cur+2] * 0x00000100 +
+		        rpt[cur+1] * 0x00000001);
+	}
+	else
+		return 0;
+}
+
+/* get_hid_usages() finds the Usage Page and Usage of every top-level
+   Application collection in report_descriptor. Returns the number
+   found, at most max. */
+static int get_hid_usages(__u8 *report_descriptor, __u32 size,
+                          unsigned short *usage_pages, unsigned short *usages, int max)
+{
+	unsigned int i = 0;
+	int size_code;
+	int data_len, key_size;
+	int depth = 0;
+	int count = 0;
+	unsigned short usage_page = 0;
+	unsigned short usage = 0;
+	unsigned short usage_usage_page = 0; /* from a 4 byte Usage */
+	int usage_found = 0;
+
+	while (i < size && count < max) {
+		int key = report_descriptor[i];
+		int key_cmd = key & 0xfc;
+		__u32 data;
+
+		if ((key & 0xf0) == 0xf0) {
+			/* This is a Long Item. The next byte contains the
+			   length of the data section (value) for this key.
+			   See the HID specification, version 1.11, section
+			   6.2.2.3, titled "Long Items." */
+			if (i+1 < size)
+				data_len = report_descriptor[i+1];
+			else
+				data_len = 0; /* malformed report */
+			key_size = 3;
+			key_cmd = 0;
+		}
+		else {
+			/* This is a Short Item. The bottom two bits of the
+			   key contain the size code for the data section
+			   (value) for this key.  Refer to the HID
+			   specification, version 1.11, section 6.2.2.2,
+			   titled "Short Items." */
+			size_code = key & 0x3;
+			data_len = (size_code == 3)? 4: size_code;
+			key_size = 1;
+		}
+
+		data = get_bytes(report_descriptor, size, data_len, i);
+
+		switch (key_cmd) {
+		case 0x04: /* Usage Page */
+			usage_page = data;
+			break;
+		case 0x08: /* Usage */
+			/* The first Usage before the Collection is the
+			   collection's usage. */
+			if (!usage_found) {
+				usage = data & 0xffff;
+				usage_usage_page = (data_len == 4)? data >> 16: 0;
+				usage_found = 1;
+			}
+			break;
+		case 0xa0: /* Collection */
+			if (depth == 0 && usage_found && data == 0x01/*Application*/) {
+				usage_pages[count] = usage_usage_page? usage_usage_page: usage_page;
+				usages[count] = usage;
+				count++;
+			}
+			depth++;
+			break;
+		case 0xc0: /* End Collection */
+			if (depth > 0)
+				depth--;
+			break;
+		}
+
+		/* Main items end the scope of the local items. */
+		if (key_cmd == 0x80 || key_cmd == 0x90 || key_cmd == 0xa0 ||
+		    key_cmd == 0xb0 || key_cmd == 0xc0)
+			usage_found = 0;
+
+		/* Skip over this key and it's associated data */
+		i += data_len + key_size;
+	}
+
+	return count;
+}
+
 /* uses_numbered_reports() returns 1 if report_descriptor describes a device
    which contains numbered reports. */
 static int uses_numbered_reports(__u8 *report_descriptor, __u32 size) {
@@ -257,20 +568,21 @@ next_line:
 }
 
 
-static int get_device_string(hid_device *dev, enum device_string_id key, wchar_t *string, size_t maxlen)
+/* Look up the manufacturer, product and serial number strings in one
+   pass and keep them in dev->strings, so the getters don't need udev. */
+static void read_device_strings(hid_device *dev)
 {
 	struct udev *udev;
 	struct udev_device *udev_dev, *parent, *hid_dev;
 	struct stat s;
-	int ret = -1;
-        char *serial_number_utf8 = NULL;
-        char *product_name_utf8 = NULL;
+	char *serial_number_utf8 = NULL;
+	char *product_name_utf8 = NULL;
 
 	/* Create the udev object */
 	udev = udev_new();
 	if (!udev) {
 		printf("Can't create udev\n");
-		return -1;
+		return;
 	}
 
 	/* Get the dev_t (major/minor numbers) from the file handle. */
@@ -285,10 +597,9 @@ static int get_device_string(hid_device *dev, enum device_string_id key, wchar_t
 		if (hid_dev) {
 			unsigned short dev_vid;
 			unsigned short dev_pid;
-			int bus_type;
-			size_t retm;
+			int bus_type = 0;
 
-			ret = parse_uevent_info(
+			parse_uevent_info(
 			           udev_device_get_sysattr_value(hid_dev, "uevent"),
 			           &bus_type,
 			           &dev_vid,
@@ -296,72 +607,48 @@ static int get_device_string(hid_device *dev, enum device_string_id key, wchar_t
 			           &serial_number_utf8,
 			           &product_name_utf8);
 
+			/* The serial number comes from the uevent for USB
+			   devices too (work around). */
+			dev->strings[DEVICE_STRING_SERIAL] = utf8_to_wchar_t(serial_number_utf8);
+
 			if (bus_type == BUS_BLUETOOTH) {
-				switch (key) {
-					case DEVICE_STRING_MANUFACTURER:
-						wcsncpy(string, L"", maxlen);
-						ret = 0;
-						break;
-					case DEVICE_STRING_PRODUCT:
-						retm = mbstowcs(string, product_name_utf8, maxlen);
-						ret = (retm == (size_t)-1)? -1: 0;
-						break;
-					case DEVICE_STRING_SERIAL:
-						retm = mbstowcs(string, serial_number_utf8, maxlen);
-						ret = (retm == (size_t)-1)? -1: 0;
-						break;
-					case DEVICE_STRING_COUNT:
-					default:
-						ret = -1;
-						break;
-				}
+				dev->strings[DEVICE_STRING_MANUFACTURER] = wcsdup(L"");
+				dev->strings[DEVICE_STRING_PRODUCT] = utf8_to_wchar_t(product_name_utf8);
 			}
 			else {
-				if (key == DEVICE_STRING_SERIAL) {	
-					/* work around */
-					retm = mbstowcs(string, serial_number_utf8, maxlen);
-					ret = (retm == (size_t)-1)? -1: 0;
-					goto end;
-				}
-			    
 				/* This is a USB device. Find its parent USB Device node. */
 				parent = udev_device_get_parent_with_subsystem_devtype(
 					   udev_dev,
 					   "usb",
 					   "usb_device");
 				if (parent) {
-					const char *str;
-					const char *key_str = NULL;
-
-					if (key >= 0 && key < DEVICE_STRING_COUNT) {
-						key_str = device_string_names[key];
-					} else {
-						ret = -1;
-						goto end;
-					}
-
-					str = udev_device_get_sysattr_value(parent, key_str);
-					if (str) {
-						/* Convert the string from UTF-8 to wchar_t */
-						retm = mbstowcs(string, str, maxlen);
-						ret = (retm == (size_t)-1)? -1: 0;
-						goto end;
-					}
+					dev->strings[DEVICE_STRING_MANUFACTURER] =
+						copy_udev_string(parent, device_string_names[DEVICE_STRING_MANUFACTURER]);
+					dev->strings[DEVICE_STRING_PRODUCT] =
+						copy_udev_string(parent, device_string_names[DEVICE_STRING_PRODUCT]);
 				}
 			}
 		}
 	}
 
-end:
-        free(serial_number_utf8);
-        free(product_name_utf8);
+	free(serial_number_utf8);
+	free(product_name_utf8);
 
 	udev_device_unref(udev_dev);
 	/* parent and hid_dev don't need to be (and can't be) unref'd.
 	   I'm not sure why, but they'll throw double-free() errors. */
 	udev_unref(udev);
+}
 
-	return ret;
+static int get_device_string(hid_device *dev, enum device_string_id key, wchar_t *string, size_t maxlen)
+{
+	if (key < 0 || key >= DEVICE_STRING_COUNT || !dev->strings[key])
+		return -1;
+
+	wcsncpy(string, dev->strings[key], maxlen);
+	string[maxlen-1] = L'\0';
+
+	return 0;
 }
 
 int HID_API_EXPORT hid_init(void)
@@ -380,265 +667,720 @@ int HID_API_EXPORT hid_init(void)
 
 int HID_API_EXPORT hid_exit(void)
 {
-	/* Nothing to do for this in the Linux/hidraw implementation. */
+	hid_set_enumeration_cache(0);
+	hotplug_stop();
 	return 0;
 }
 
 
-struct hid_device_info  HID_API_EXPORT *hid_enumerate(unsigned short vendor_id, unsigned short product_id)
+void  HID_API_EXPORT hid_free_enumeration(struct hid_device_info *devs)
 {
-	struct udev *udev;
-	struct udev_enumerate *enumerate;
-	struct udev_list_entry *devices, *dev_list_entry;
+	struct hid_device_info *d = devs;
+	while (d) {
+		struct hid_device_info *next = d->next;
+		free(d->path);
+		free(d->serial_number);
+		free(d->manufacturer_string);
+		free(d->product_string);
+		free(d);
+		d = next;
+	}
+}
 
-	struct hid_device_info *root = NULL; /* return object */
-	struct hid_device_info *cur_dev = NULL;
-	struct hid_device_info *prev_dev = NULL; /* previous device */
+static struct hid_device_info *copy_device_info(const struct hid_device_info *info)
+{
+	struct hid_device_info *copy = malloc(sizeof(struct hid_device_info));
 
-	hid_init();
+	*copy = *info;
+	copy->next = NULL;
+	copy->path = info->path? strdup(info->path): NULL;
+	copy->serial_number = info->serial_number? wcsdup(info->serial_number): NULL;
+	copy->manufacturer_string = info->manufacturer_string? wcsdup(info->manufacturer_string): NULL;
+	copy->product_string = info->product_string? wcsdup(info->product_string): NULL;
 
-	/* Create the udev object */
-	udev = udev_new();
-	if (!udev) {
-		printf("Can't create udev\n");
-		return NULL;
-	}
+	return copy;
+}
 
-	/* Create a list of the devices in the 'hidraw' subsystem. */
-	enumerate = udev_enumerate_new(udev);
-	udev_enumerate_add_match_subsystem(enumerate, "hidraw");
-	udev_enumerate_scan_devices(enumerate);
-	devices = udev_enumerate_get_list_entry(enumerate);
-	/* For each item, see if it matches the vid/pid, and if so
-	   create a udev_device record for it */
-	udev_list_entry_foreach(dev_list_entry, devices) {
-		const char *sysfs_path;
-		const char *dev_path;
-		const char *str;
-		struct udev_device *raw_dev; /* The device's hidraw udev node. */
-		struct udev_device *hid_dev; /* The device's HID udev node. */
-		struct udev_device *usb_dev; /* The device's USB udev node. */
-		struct udev_device *intf_dev; /* The device's interface (in the USB sense). */
-		unsigned short dev_vid;
-		unsigned short dev_pid;
-		char *serial_number_utf8 = NULL;
-		char *product_name_utf8 = NULL;
-		int bus_type;
-		int result;
+/* Fill in the usage of a record from the report descriptor at path
+   (relative to dirfd). A device with more than one top-level
+   collection gets a copy of the record for each of them, appended to
+   info. Returns info. */
+static struct hid_device_info *add_usages(struct hid_device_info *info, int dirfd, const char *path)
+{
+	__u8 report_descriptor[HID_MAX_DESCRIPTOR_SIZE];
+	unsigned short usage_pages[MAX_TOP_LEVEL_USAGES];
+	unsigned short usages[MAX_TOP_LEVEL_USAGES];
+	ssize_t size;
+	int count, fd, i;
+
+	fd = openat(dirfd, path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return info;
+	size = read(fd, report_descriptor, sizeof(report_descriptor));
+	close(fd);
+	if (size <= 0)
+		return info;
+
+	count = get_hid_usages(report_descriptor, size, usage_pages, usages, MAX_TOP_LEVEL_USAGES);
+	if (count == 0)
+		return info;
+
+	info->usage_page = usage_pages[0];
+	info->usage = usages[0];
+	for (i = count - 1; i > 0; i--) {
+		struct hid_device_info *copy = copy_device_info(info);
+		copy->usage_page = usage_pages[i];
+		copy->usage = usages[i];
+		copy->next = info->next;
+		info->next = copy;
+	}
 
-		/* Get the filename of the /sys entry for the device
-		   and create a udev_device object (dev) representing it */
-		sysfs_path = udev_list_entry_get_name(dev_list_entry);
-		raw_dev = udev_device_new_from_syspath(udev, sysfs_path);
-		dev_path = udev_device_get_devnode(raw_dev);
+	return info;
+}
 
-		hid_dev = udev_device_get_parent_with_subsystem_devtype(
-			raw_dev,
-			"hid",
-			NULL);
+/* Create the records for a hidraw udev node if it is a USB or Bluetooth
+   device matching vendor_id and product_id (0 matches any), one per
+   top-level collection. Returns NULL otherwise. */
+static struct hid_device_info *create_device_info(struct udev_device *raw_dev, unsigned short vendor_id, unsigned short product_id)
+{
+	const char *dev_path;
+	const char *str;
+	struct udev_device *hid_dev; /* The device's HID udev node. */
+	struct udev_device *usb_dev; /* The device's USB udev node. */
+	struct udev_device *intf_dev; /* The device's interface (in the USB sense). */
+	struct hid_device_info *cur_dev = NULL;
+	unsigned short dev_vid;
+	unsigned short dev_pid;
+	char *serial_number_utf8 = NULL;
+	char *product_name_utf8 = NULL;
+	int bus_type;
+	int result;
+
+	dev_path = udev_device_get_devnode(raw_dev);
+
+	hid_dev = udev_device_get_parent_with_subsystem_devtype(
+		raw_dev,
+		"hid",
+		NULL);
+
+	if (!hid_dev) {
+		/* Unable to find parent hid device. */
+		goto end;
+	}
 
-		if (!hid_dev) {
-			/* Unable to find parent hid device. */
-			goto next;
-		}
+	result = parse_uevent_info(
+		udev_device_get_sysattr_value(hid_dev, "uevent"),
+		&bus_type,
+		&dev_vid,
+		&dev_pid,
+		&serial_number_utf8,
+		&product_name_utf8);
+
+	if (!result) {
+		/* parse_uevent_info() failed for at least one field. */
+		goto end;
+	}
 
-		result = parse_uevent_info(
-			udev_device_get_sysattr_value(hid_dev, "uevent"),
-			&bus_type,
-			&dev_vid,
-			&dev_pid,
-			&serial_number_utf8,
-			&product_name_utf8);
+	if (bus_type != BUS_USB && bus_type != BUS_BLUETOOTH) {
+		/* We only know how to handle USB and BT devices. */
+		goto end;
+	}
 
-		if (!result) {
-			/* parse_uevent_info() failed for at least one field. */
-			goto next;
-		}
+	/* Check the VID/PID against the arguments */
+	if ((vendor_id != 0x0 && vendor_id != dev_vid) ||
+	    (product_id != 0x0 && product_id != dev_pid)) {
+		goto end;
+	}
 
-		if (bus_type != BUS_USB && bus_type != BUS_BLUETOOTH) {
-			/* We only know how to handle USB and BT devices. */
-			goto next;
-		}
+	/* VID/PID match. Create the record. */
+	cur_dev = malloc(sizeof(struct hid_device_info));
+
+	/* Fill out the record */
+	cur_dev->next = NULL;
+	cur_dev->path = dev_path? strdup(dev_path): NULL;
+
+	/* VID/PID */
+	cur_dev->vendor_id = dev_vid;
+	cur_dev->product_id = dev_pid;
+
+	/* Serial Number */
+	cur_dev->serial_number = utf8_to_wchar_t(serial_number_utf8);
+
+	/* Release Number */
+	cur_dev->release_number = 0x0;
+
+	/* Interface Number */
+	cur_dev->interface_number = -1;
+
+	/* Usage Page and Usage, if there is no report descriptor */
+	cur_dev->usage_page = 0x0;
+	cur_dev->usage = 0x0;
+
+	switch (bus_type) {
+		case BUS_USB:
+			/* The device pointed to by raw_dev contains information about
+			   the hidraw device. In order to get information about the
+			   USB device, get the parent device with the
+			   subsystem/devtype pair of "usb"/"usb_device". This will
+			   be several levels up the tree, but the function will find
+			   it. */
+			usb_dev = udev_device_get_parent_with_subsystem_devtype(
+					raw_dev,
+					"usb",
+					"usb_device");
+
+			if (!usb_dev) {
+				/* Free this device */
+				free(cur_dev->serial_number);
+				free(cur_dev->path);
+				free(cur_dev);
+				cur_dev = NULL;
+
+				goto end;
+			}
 
-		/* Check the VID/PID against the arguments */
-		if ((vendor_id == 0x0 || vendor_id == dev_vid) &&
-		    (product_id == 0x0 || product_id == dev_pid)) {
-			struct hid_device_info *tmp;
+			/* Manufacturer and Product strings */
+			cur_dev->manufacturer_string = copy_udev_string(usb_dev, device_string_names[DEVICE_STRING_MANUFACTURER]);
+			cur_dev->product_string = copy_udev_string(usb_dev, device_string_names[DEVICE_STRING_PRODUCT]);
 
-			/* VID/PID match. Create the record. */
-			tmp = malloc(sizeof(struct hid_device_info));
-			if (cur_dev) {
-				cur_dev->next = tmp;
-			}
-			else {
-				root = tmp;
+			/* Release Number */
+			str = udev_device_get_sysattr_value(usb_dev, "bcdDevice");
+			cur_dev->release_number = (str)? strtol(str, NULL, 16): 0x0;
+
+			/* Get a handle to the interface's udev node. */
+			intf_dev = udev_device_get_parent_with_subsystem_devtype(
+					raw_dev,
+					"usb",
+					"usb_interface");
+			if (intf_dev) {
+				str = udev_device_get_sysattr_value(intf_dev, "bInterfaceNumber");
+				cur_dev->interface_number = (str)? strtol(str, NULL, 16): -1;
 			}
-			prev_dev = cur_dev;
-			cur_dev = tmp;
 
-			/* Fill out the record */
-			cur_dev->next = NULL;
-			cur_dev->path = dev_path? strdup(dev_path): NULL;
+			break;
 
-			/* VID/PID */
-			cur_dev->vendor_id = dev_vid;
-			cur_dev->product_id = dev_pid;
+		case BUS_BLUETOOTH:
+			/* Manufacturer and Product strings */
+			cur_dev->manufacturer_string = wcsdup(L"");
+			cur_dev->product_string = utf8_to_wchar_t(product_name_utf8);
 
-			/* Serial Number */
-			cur_dev->serial_number = utf8_to_wchar_t(serial_number_utf8);
+			break;
 
-			/* Release Number */
-			cur_dev->release_number = 0x0;
-
-			/* Interface Number */
-			cur_dev->interface_number = -1;
-
-			switch (bus_type) {
-				case BUS_USB:
-					/* The device pointed to by raw_dev contains information about
-					   the hidraw device. In order to get information about the
-					   USB device, get the parent device with the
-					   subsystem/devtype pair of "usb"/"usb_device". This will
-					   be several levels up the tree, but the function will find
-					   it. */
-					usb_dev = udev_device_get_parent_with_subsystem_devtype(
-							raw_dev,
-							"usb",
-							"usb_device");
-
-					if (!usb_dev) {
-						/* Free this device */
-						free(cur_dev->serial_number);
-						free(cur_dev->path);
-						free(cur_dev);
-
-						/* Take it off the device list. */
-						if (prev_dev) {
-							prev_dev->next = NULL;
-							cur_dev = prev_dev;
-						}
-						else {
-							cur_dev = root = NULL;
-						}
-
-						goto next;
-					}
-
-					/* Manufacturer and Product strings */
-					cur_dev->manufacturer_string = copy_udev_string(usb_dev, device_string_names[DEVICE_STRING_MANUFACTURER]);
-					cur_dev->product_string = copy_udev_string(usb_dev, device_string_names[DEVICE_STRING_PRODUCT]);
-
-					/* Release Number */
-					str = udev_device_get_sysattr_value(usb_dev, "bcdDevice");
-					cur_dev->release_number = (str)? strtol(str, NULL, 16): 0x0;
-
-					/* Get a handle to the interface's udev node. */
-					intf_dev = udev_device_get_parent_with_subsystem_devtype(
-							raw_dev,
-							"usb",
-							"usb_interface");
-					if (intf_dev) {
-						str = udev_device_get_sysattr_value(intf_dev, "bInterfaceNumber");
-						cur_dev->interface_number = (str)? strtol(str, NULL, 16): -1;
-					}
+		default:
+			/* Unknown device type - this should never happen, as we
+			 * check for USB and Bluetooth devices above */
+			break;
+	}
 
-					break;
+	/* Usage Page and Usage */
+	str = udev_device_get_syspath(hid_dev);
+	if (str) {
+		char path[PATH_MAX];
+		snprintf(path, sizeof(path), "%s/report_descriptor", str);
+		cur_dev = add_usages(cur_dev, AT_FDCWD, path);
+	}
 
-				case BUS_BLUETOOTH:
-					/* Manufacturer and Product strings */
-					cur_dev->manufacturer_string = wcsdup(L"");
-					cur_dev->product_string = utf8_to_wchar_t(product_name_utf8);
+end:
+	free(serial_number_utf8);
+	free(product_name_utf8);
+	/* hid_dev, usb_dev and intf_dev don't need to be (and can't be)
+	   unref()d.  It will cause a double-free() error.  I'm not
+	   sure why.  */
 
-					break;
+	return cur_dev;
+}
 
-				default:
-					/* Unknown device type - this should never happen, as we
-					 * check for USB and Bluetooth devices above */
-					break;
-			}
-		}
+/* Read a sysfs attribute relative to dirfd into buf, without the
+   trailing newline. Returns the length, or -1 if it can't be read. */
+static int read_sysfs_attr(int dirfd, const char *path, char *buf, size_t size)
+{
+	int fd;
+	ssize_t len;
 
-	next:
-		free(serial_number_utf8);
-		free(product_name_utf8);
-		udev_device_unref(raw_dev);
-		/* hid_dev, usb_dev and intf_dev don't need to be (and can't be)
-		   unref()d.  It will cause a double-free() error.  I'm not
-		   sure why.  */
-	}
-	/* Free the enumerator and udev objects. */
-	udev_enumerate_unref(enumerate);
-	udev_unref(udev);
+	fd = openat(dirfd, path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return -1;
+	len = read(fd, buf, size - 1);
+	close(fd);
+	if (len < 0)
+		return -1;
 
-	return root;
+	if (len > 0 && buf[len-1] == '\n')
+		len--;
+	buf[len] = '\0';
+
+	return len;
 }
 
-void  HID_API_EXPORT hid_free_enumeration(struct hid_device_info *devs)
+/* Same as create_device_info(), but reads sysfs directly. name is a
+   hidraw node in /sys/class/hidraw, which dirfd refers to. */
+static struct hid_device_info *create_device_info_sysfs(int dirfd, const char *name, char *buf, size_t size, unsigned short vendor_id, unsigned short product_id)
 {
-	struct hid_device_info *d = devs;
-	while (d) {
-		struct hid_device_info *next = d->next;
-		free(d->path);
-		free(d->serial_number);
-		free(d->manufacturer_string);
-		free(d->product_string);
-		free(d);
-		d = next;
+	struct hid_device_info *cur_dev = NULL;
+	unsigned short dev_vid;
+	unsigned short dev_pid;
+	char *serial_number_utf8 = NULL;
+	char *product_name_utf8 = NULL;
+	char attr[PATH_MAX];
+	int bus_type;
+	int result;
+
+	/* The device link points at the HID node, the same one
+	   create_device_info() gets from udev. */
+	snprintf(attr, sizeof(attr), "%s/device/uevent", name);
+	if (read_sysfs_attr(dirfd, attr, buf, size) < 0)
+		goto end;
+
+	result = parse_uevent_info(
+		buf,
+		&bus_type,
+		&dev_vid,
+		&dev_pid,
+		&serial_number_utf8,
+		&product_name_utf8);
+
+	if (!result) {
+		/* parse_uevent_info() failed for at least one field. */
+		goto end;
+	}
+
+	if (bus_type != BUS_USB && bus_type != BUS_BLUETOOTH) {
+		/* We only know how to handle USB and BT devices. */
+		goto end;
+	}
+
+	/* Check the VID/PID against the arguments. Nothing else is read
+	   for devices which don't match. */
+	if ((vendor_id != 0x0 && vendor_id != dev_vid) ||
+	    (product_id != 0x0 && product_id != dev_pid)) {
+		goto end;
+	}
+
+	cur_dev = calloc(1, sizeof(struct hid_device_info));
+
+	snprintf(attr, sizeof(attr), "/dev/%s", name);
+	cur_dev->path = strdup(attr);
+	cur_dev->vendor_id = dev_vid;
+	cur_dev->product_id = dev_pid;
+	cur_dev->serial_number = utf8_to_wchar_t(serial_number_utf8);
+	cur_dev->interface_number = -1;
+
+	if (bus_type == BUS_USB) {
+		/* The HID node sits below the USB interface node, which sits
+		   below the USB device node. */
+		snprintf(attr, sizeof(attr), "%s/device/../../idVendor", name);
+		if (read_sysfs_attr(dirfd, attr, buf, size) < 0) {
+			/* Not a usb_device, see create_device_info(). */
+			free(cur_dev->serial_number);
+			free(cur_dev->path);
+			free(cur_dev);
+			cur_dev = NULL;
+			goto end;
+		}
+
+		/* Manufacturer and Product strings */
+		snprintf(attr, sizeof(attr), "%s/device/../../manufacturer", name);
+		if (read_sysfs_attr(dirfd, attr, buf, size) >= 0)
+			cur_dev->manufacturer_string = utf8_to_wchar_t(buf);
+		snprintf(attr, sizeof(attr), "%s/device/../../product", name);
+		if (read_sysfs_attr(dirfd, attr, buf, size) >= 0)
+			cur_dev->product_string = utf8_to_wchar_t(buf);
+
+		/* Release Number */
+		snprintf(attr, sizeof(attr), "%s/device/../../bcdDevice", name);
+		if (read_sysfs_attr(dirfd, attr, buf, size) >= 0)
+			cur_dev->release_number = strtol(buf, NULL, 16);
+
+		/* Interface Number */
+		snprintf(attr, sizeof(attr), "%s/device/../bInterfaceNumber", name);
+		if (read_sysfs_attr(dirfd, attr, buf, size) >= 0)
+			cur_dev->interface_number = strtol(buf, NULL, 16);
+	}
+	else {
+		/* Manufacturer and Product strings */
+		cur_dev->manufacturer_string = wcsdup(L"");
+		cur_dev->product_string = utf8_to_wchar_t(product_name_utf8);
 	}
+
+	/* Usage Page and Usage */
+	snprintf(attr, sizeof(attr), "%s/device/report_descriptor", name);
+	cur_dev = add_usages(cur_dev, dirfd, attr);
+
+end:
+	free(serial_number_utf8);
+	free(product_name_utf8);
+
+	return cur_dev;
 }
 
-hid_device * hid_open(unsigned short vendor_id, unsigned short product_id, const wchar_t *serial_number)
+static struct hid_device_info *enumerate_sysfs(unsigned short vendor_id, unsigned short product_id)
 {
-	struct hid_device_info *devs, *cur_dev;
-	const char *path_to_open = NULL;
-	hid_device *handle = NULL;
+	struct hid_device_info *root = NULL; /* return object */
+	struct hid_device_info *cur_dev = NULL;
+	struct dirent *entry;
+	char buf[4096]; /* reused for every attribute */
+	DIR *dir;
 
-	devs = hid_enumerate(vendor_id, product_id);
-	cur_dev = devs;
-	while (cur_dev) {
-		if (cur_dev->vendor_id == vendor_id &&
-		    cur_dev->product_id == product_id) {
-			if (serial_number) {
-				if (wcscmp(serial_number, cur_dev->serial_number) == 0) {
-					path_to_open = cur_dev->path;
-					break;
-				}
+	dir = opendir("/sys/class/hidraw");
+	if (!dir)
+		return NULL;
+
+	while ((entry = readdir(dir)) != NULL) {
+		struct hid_device_info *tmp;
+
+		if (strncmp(entry->d_name, "hidraw", 6) != 0)
+			continue;
+
+		tmp = create_device_info_sysfs(dirfd(dir), entry->d_name,
+			buf, sizeof(buf), vendor_id, product_id);
+		if (tmp) {
+			if (cur_dev) {
+				cur_dev->next = tmp;
 			}
 			else {
-				path_to_open = cur_dev->path;
-				break;
+				root = tmp;
 			}
+			for (cur_dev = tmp; cur_dev->next; cur_dev = cur_dev->next)
+				;
 		}
-		cur_dev = cur_dev->next;
 	}
+	closedir(dir);
 
-	if (path_to_open) {
-		/* Open the device */
-		handle = hid_open_path(path_to_open);
-	}
+	return root;
+}
 
-	hid_free_enumeration(devs);
+int HID_API_EXPORT hid_set_enumeration_sysfs(int enable)
+{
+	enum_sysfs = enable;
+	return 0;
+}
 
-	return handle;
+/* Drop the cached record of the hidraw node at syspath, if there is one. */
+static void enum_cache_remove(const char *syspath)
+{
+	struct enum_cache_entry **e = &enum_cache.entries;
+
+	while (*e) {
+		if (strcmp((*e)->syspath, syspath) == 0) {
+			struct enum_cache_entry *gone = *e;
+			*e = gone->next;
+			if (enum_cache.tail == &gone->next)
+				enum_cache.tail = e;
+			hid_free_enumeration(gone->info);
+			free(gone->syspath);
+			free(gone);
+			return;
+		}
+		e = &(*e)->next;
+	}
 }
 
-hid_device * HID_API_EXPORT hid_open_path(const char *path)
+static void enum_cache_add(struct udev_device *raw_dev)
 {
-	hid_device *dev = NULL;
+	struct enum_cache_entry *entry;
+	struct hid_device_info *info;
 
-	hid_init();
+	/* A device which is already known is reported as added again when
+	   it shows up in the initial scan after the monitor was started. */
+	enum_cache_remove(udev_device_get_syspath(raw_dev));
 
-	dev = new_hid_device();
+	info = create_device_info(raw_dev, 0, 0);
+	if (!info)
+		return;
 
-	/* OPEN HERE */
-	dev->device_handle = open(path, O_RDWR);
+	entry = malloc(sizeof(struct enum_cache_entry));
+	entry->syspath = strdup(udev_device_get_syspath(raw_dev));
+	entry->info = info;
+	entry->next = NULL;
 
-	/* If we have a good handle, return it. */
-	/* test test shoud be >= 0 even if it is not so likely (I guess) */
-	if (dev->device_handle > 0) {
+	/* Keep the order of the udev scan, new devices go to the end. */
+	*enum_cache.tail = entry;
+	enum_cache.tail = &entry->next;
+}
 
-		/* Get the report descriptor */
-		int res, desc_size = 0;
+/* Add all the hidraw nodes which are there right now. */
+static void enum_cache_scan(void)
+{
+	struct udev_enumerate *enumerate;
+	struct udev_list_entry *devices, *dev_list_entry;
+
+	enumerate = udev_enumerate_new(enum_cache.udev);
+	udev_enumerate_add_match_subsystem(enumerate, "hidraw");
+	udev_enumerate_scan_devices(enumerate);
+	devices = udev_enumerate_get_list_entry(enumerate);
+	udev_list_entry_foreach(dev_list_entry, devices) {
+		struct udev_device *raw_dev = udev_device_new_from_syspath(enum_cache.udev,
+			udev_list_entry_get_name(dev_list_entry));
+		if (raw_dev) {
+			enum_cache_add(raw_dev);
+			udev_device_unref(raw_dev);
+		}
+	}
+	udev_enumerate_unref(enumerate);
+}
+
+/* Apply the hotplug events which arrived since the last call. */
+static void enum_cache_update(void)
+{
+	struct udev_device *raw_dev;
+	int overflow = 0;
+
+	for (;;) {
+		const char *action;
+
+		errno = 0;
+		raw_dev = udev_monitor_receive_device(enum_cache.monitor);
+		if (!raw_dev) {
+			/* The socket buffer overflowed, some events are
+			   lost. Keep reading what is left. */
+			if (errno == ENOBUFS) {
+				overflow = 1;
+				continue;
+			}
+			break;
+		}
+
+		action = udev_device_get_action(raw_dev);
+		if (action && strcmp(action, "remove") == 0)
+			enum_cache_remove(udev_device_get_syspath(raw_dev));
+		else if (action && strcmp(action, "add") == 0)
+			enum_cache_add(raw_dev);
+
+		udev_device_unref(raw_dev);
+	}
+
+	if (overflow) {
+		/* Build the cache again from scratch. */
+		while (enum_cache.entries)
+			enum_cache_remove(enum_cache.entries->syspath);
+		enum_cache_scan();
+	}
+}
+
+static void enum_cache_clear(void)
+{
+	while (enum_cache.entries)
+		enum_cache_remove(enum_cache.entries->syspath);
+
+	if (enum_cache.monitor)
+		udev_monitor_unref(enum_cache.monitor);
+	if (enum_cache.udev)
+		udev_unref(enum_cache.udev);
+	enum_cache.monitor = NULL;
+	enum_cache.udev = NULL;
+}
+
+int HID_API_EXPORT hid_set_enumeration_cache(int enable)
+{
+	int res = 0;
+
+	pthread_mutex_lock(&enum_cache.mutex);
+
+	if (!enable) {
+		enum_cache_clear();
+		goto out;
+	}
+	if (enum_cache.monitor)
+		goto out;
+
+	enum_cache.udev = udev_new();
+	if (!enum_cache.udev) {
+		printf("Can't create udev\n");
+		res = -1;
+		goto out;
+	}
+
+	/* Start listening before the scan, so no device can slip through
+	   in between. Devices seen twice are sorted out by
+	   enum_cache_add(). */
+	enum_cache.monitor = udev_monitor_new_from_netlink(enum_cache.udev, "udev");
+	if (!enum_cache.monitor ||
+	    udev_monitor_filter_add_match_subsystem_devtype(enum_cache.monitor, "hidraw", NULL) < 0 ||
+	    udev_monitor_enable_receiving(enum_cache.monitor) < 0) {
+		enum_cache_clear();
+		res = -1;
+		goto out;
+	}
+	/* Not fatal, the default size only overflows sooner, and
+	   enum_cache_update() rescans then. */
+	udev_monitor_set_receive_buffer_size(enum_cache.monitor, MONITOR_BUFFER_SIZE);
+
+	enum_cache_scan();
+
+out:
+	pthread_mutex_unlock(&enum_cache.mutex);
+
+	return res;
+}
+
+struct hid_device_info  HID_API_EXPORT *hid_enumerate(unsigned short vendor_id, unsigned short product_id)
+{
+	struct udev *udev;
+	struct udev_enumerate *enumerate;
+	struct udev_list_entry *devices, *dev_list_entry;
+
+	struct hid_device_info *root = NULL; /* return object */
+	struct hid_device_info *cur_dev = NULL;
+
+	hid_init();
+
+	pthread_mutex_lock(&enum_cache.mutex);
+	if (enum_cache.monitor) {
+		struct enum_cache_entry *e;
+
+		enum_cache_update();
+
+		/* Hand out copies, the caller frees them with
+		   hid_free_enumeration(). */
+		for (e = enum_cache.entries; e; e = e->next) {
+			struct hid_device_info *info;
+
+			if ((vendor_id != 0x0 && vendor_id != e->info->vendor_id) ||
+			    (product_id != 0x0 && product_id != e->info->product_id))
+				continue;
+
+			for (info = e->info; info; info = info->next) {
+				struct hid_device_info *tmp = copy_device_info(info);
+				if (cur_dev)
+					cur_dev->next = tmp;
+				else
+					root = tmp;
+				cur_dev = tmp;
+			}
+		}
+		pthread_mutex_unlock(&enum_cache.mutex);
+
+		return root;
+	}
+	pthread_mutex_unlock(&enum_cache.mutex);
+
+	if (enum_sysfs)
+		return enumerate_sysfs(vendor_id, product_id);
+
+	/* Create the udev object */
+	udev = udev_new();
+	if (!udev) {
+		printf("Can't create udev\n");
+		return NULL;
+	}
+
+	/* Create a list of the devices in the 'hidraw' subsystem. */
+	enumerate = udev_enumerate_new(udev);
+	udev_enumerate_add_match_subsystem(enumerate, "hidraw");
+	udev_enumerate_scan_devices(enumerate);
+	devices = udev_enumerate_get_list_entry(enumerate);
+	/* For each item, see if it matches the vid/pid, and if so
+	   create a udev_device record for it */
+	udev_list_entry_foreach(dev_list_entry, devices) {
+		const char *sysfs_path;
+		struct udev_device *raw_dev; /* The device's hidraw udev node. */
+		struct hid_device_info *tmp;
+
+		/* Get the filename of the /sys entry for the device
+		   and create a udev_device object (dev) representing it */
+		sysfs_path = udev_list_entry_get_name(dev_list_entry);
+		raw_dev = udev_device_new_from_syspath(udev, sysfs_path);
+
+		tmp = create_device_info(raw_dev, vendor_id, product_id);
+		if (tmp) {
+			if (cur_dev) {
+				cur_dev->next = tmp;
+			}
+			else {
+				root = tmp;
+			}
+			/* One record per top-level collection. */
+			for (cur_dev = tmp; cur_dev->next; cur_dev = cur_dev->next)
+				;
+		}
+
+		udev_device_unref(raw_dev);
+	}
+	/* Free the enumerator and udev objects. */
+	udev_enumerate_unref(enumerate);
+	udev_unref(udev);
+
+	return root;
+}
+
+struct hid_device_info  HID_API_EXPORT *hid_enumerate_usage(unsigned short vendor_id, unsigned short product_id, unsigned short usage_page, unsigned short usage)
+{
+	struct hid_device_info *root = hid_enumerate(vendor_id, product_id);
+	struct hid_device_info **d = &root;
+
+	/* No device has been opened for the records, the ones which don't
+	   match are only dropped again. */
+	while (*d) {
+		struct hid_device_info *cur = *d;
+
+		if ((usage_page == 0x0 || usage_page == cur->usage_page) &&
+		    (usage == 0x0 || usage == cur->usage)) {
+			d = &cur->next;
+			continue;
+		}
+
+		*d = cur->next;
+		cur->next = NULL;
+		hid_free_enumeration(cur);
+	}
+
+	return root;
+}
+
+hid_device * hid_open(unsigned short vendor_id, unsigned short product_id, const wchar_t *serial_number)
+{
+	struct hid_device_info *devs, *cur_dev;
+	const char *path_to_open = NULL;
+	hid_device *handle = NULL;
+
+	devs = hid_enumerate(vendor_id, product_id);
+	cur_dev = devs;
+	while (cur_dev) {
+		if (cur_dev->vendor_id == vendor_id &&
+		    cur_dev->product_id == product_id) {
+			if (serial_number) {
+				if (wcscmp(serial_number, cur_dev->serial_number) == 0) {
+					path_to_open = cur_dev->path;
+					break;
+				}
+			}
+			else {
+				path_to_open = cur_dev->path;
+				break;
+			}
+		}
+		cur_dev = cur_dev->next;
+	}
+
+	if (path_to_open) {
+		/* Open the device */
+		handle = hid_open_path(path_to_open);
+	}
+
+	hid_free_enumeration(devs);
+
+	return handle;
+}
+
+hid_device * HID_API_EXPORT hid_open_path(const char *path)
+{
+	hid_device *dev = NULL;
+
+	hid_init();
+
+	dev = new_hid_device();
+
+	/* OPEN HERE. Non-blocking so hid_read_batch() can drain the
+	   kernel's queue until read() returns EAGAIN; hid_read_timeout()
+	   always poll()s first. */
+	dev->device_handle = open(path, O_RDWR | O_NONBLOCK);
+
+	/* If we have a good handle, return it. */
+	/* test test shoud be >= 0 even if it is not so likely (I guess) */
+	if (dev->device_handle > 0) {
+
+		/* Get the report descriptor */
+		int res, desc_size = 0;
 		struct hidraw_report_descriptor rpt_desc;
 
 		memset(&rpt_desc, 0x0, sizeof(rpt_desc));
@@ -661,6 +1403,8 @@ hid_device * HID_API_EXPORT hid_open_path(const char *path)
 				                      rpt_desc.size);
 		}
 
+		read_device_strings(dev);
+
 		return dev;
 	}
 	else {
@@ -698,48 +1442,159 @@ int HID_API_EXPORT hid_get_report_descriptor(hid_device *dev, unsigned char *dat
 int HID_API_EXPORT hid_write(hid_device *dev, const unsigned char *data, size_t length)
 {
 	int bytes_written;
+	uint64_t start = monotonic_ns();
 
 	bytes_written = write(dev->device_handle, data, length);
 
+	start = monotonic_ns() - start;
+	STATS_ADD(dev, writes, 1);
+	STATS_ADD(dev, write_time_ns, start);
+	stats_max(&dev->stats.max_write_time_ns, start);
+	histogram_record(dev, HID_HISTOGRAM_WRITE, start);
+	HID_PROBE3(write, dev, length, start);
+
 	return bytes_written;
 }
 
+int HID_API_EXPORT hid_write_async(hid_device *dev, const unsigned char *data, size_t length, hid_write_callback callback, void *user_data)
+{
+	/* hidraw has no asynchronous writes, the write() of a report
+	   blocks until the device has taken it. */
+	int res = hid_write(dev, data, length);
+
+	if (callback)
+		callback(dev, res, user_data);
+	return (res < 0) ? -1 : 0;
+}
 
-int HID_API_EXPORT hid_read_timeout(hid_device *dev, unsigned char *data, size_t length, int milliseconds)
+/* Send the pending reports of hid_write_latest(), oldest report ID
+   first, as fast as hid_write() returns. */
+static void *writer_thread(void *param)
 {
-	int bytes_read;
+	hid_device *dev = param;
+	struct pending_report *rpt;
+
+	pthread_mutex_lock(&dev->writer_mutex);
+	while (!dev->writer_shutdown) {
+		rpt = dev->pending_reports;
+		if (!rpt) {
+			pthread_cond_wait(&dev->writer_condition, &dev->writer_mutex);
+			continue;
+		}
+		dev->pending_reports = rpt->next;
+		pthread_mutex_unlock(&dev->writer_mutex);
+
+		hid_write(dev, rpt->data, rpt->length);
+
+		pthread_mutex_lock(&dev->writer_mutex);
+		rpt->next = dev->free_reports;
+		dev->free_reports = rpt;
+	}
+	pthread_mutex_unlock(&dev->writer_mutex);
+
+	return NULL;
+}
+
+int HID_API_EXPORT hid_write_latest(hid_device *dev, const unsigned char *data, size_t length)
+{
+	struct pending_report *rpt, **r;
+
+	if (length == 0) {
+		errno = EINVAL;
+		return -1;
+	}
 
-	if (milliseconds >= 0) {
-		/* Milliseconds is either 0 (non-blocking) or > 0 (contains
-		   a valid timeout). In both cases we want to call poll()
-		   and wait for data to arrive.  Don't rely on non-blocking
-		   operation (O_NONBLOCK) since some kernels don't seem to
-		   properly report device disconnection through read() when
-		   in non-blocking mode.  */
-		int ret;
-		struct pollfd fds;
-
-		fds.fd = dev->device_handle;
-		fds.events = POLLIN;
-		fds.revents = 0;
-		ret = poll(&fds, 1, milliseconds);
-		if (ret == -1 || ret == 0) {
-			/* Error or timeout */
-			return ret;
+	pthread_mutex_lock(&dev->writer_mutex);
+
+	if (!dev->writer_started) {
+		if (pthread_create(&dev->writer, NULL, writer_thread, dev) != 0) {
+			pthread_mutex_unlock(&dev->writer_mutex);
+			return -1;
 		}
-		else {
-			/* Check for errors on the file descriptor. This will
-			   indicate a device disconnection. */
-			if (fds.revents & (POLLERR | POLLHUP | POLLNVAL))
-				return -1;
+		dev->writer_started = 1;
+	}
+
+	/* Replace a pending report with the same report ID, or queue a
+	   new one. */
+	for (r = &dev->pending_reports; *r; r = &(*r)->next) {
+		if ((*r)->data[0] == data[0])
+			break;
+	}
+	rpt = *r;
+	if (!rpt) {
+		rpt = dev->free_reports;
+		if (rpt)
+			dev->free_reports = rpt->next;
+		else
+			rpt = calloc(1, sizeof(struct pending_report));
+	}
+	if (rpt && rpt->size < length) {
+		unsigned char *buf = realloc(rpt->data, length);
+		if (buf) {
+			rpt->data = buf;
+			rpt->size = length;
+		}
+	}
+	if (!rpt || rpt->size < length) {
+		if (rpt && rpt != *r) {
+			rpt->next = dev->free_reports;
+			dev->free_reports = rpt;
 		}
+		pthread_mutex_unlock(&dev->writer_mutex);
+		errno = ENOMEM;
+		return -1;
 	}
 
-	bytes_read = read(dev->device_handle, data, length);
-	if (bytes_read < 0 && (errno == EAGAIN || errno == EINPROGRESS))
-		bytes_read = 0;
+	if (rpt == *r) {
+		STATS_ADD(dev, writes_replaced, 1);
+	}
+	else {
+		rpt->next = NULL;
+		*r = rpt;
+	}
+	memcpy(rpt->data, data, length);
+	rpt->length = length;
+
+	pthread_cond_signal(&dev->writer_condition);
+	pthread_mutex_unlock(&dev->writer_mutex);
+
+	return length;
+}
+
+/* Stop writer_thread(), dropping the reports it has not sent yet. */
+static void writer_stop(hid_device *dev)
+{
+	struct pending_report *lists[2];
+	int i;
+
+	pthread_mutex_lock(&dev->writer_mutex);
+	dev->writer_shutdown = 1;
+	pthread_cond_signal(&dev->writer_condition);
+	pthread_mutex_unlock(&dev->writer_mutex);
+	if (dev->writer_started)
+		pthread_join(dev->writer, NULL);
+
+	lists[0] = dev->pending_reports;
+	lists[1] = dev->free_reports;
+	for (i = 0; i < 2; i++) {
+		while (lists[i]) {
+			struct pending_report *next = lists[i]->next;
+			free(lists[i]->data);
+			free(lists[i]);
+			lists[i] = next;
+		}
+	}
+
+	pthread_cond_destroy(&dev->writer_condition);
+	pthread_mutex_destroy(&dev->writer_mutex);
+}
 
-	if (bytes_read >= 0 &&
+
+/* Fix up a report which has just been read and hand it to the input
+   report callback. Returns the length of the report. */
+static int deliver_report(hid_device *dev, unsigned char *data, int bytes_read, uint64_t timestamp)
+{
+	if (bytes_read > 0 &&
 	    kernel_version != 0 &&
 	    kernel_version < KERNEL_VERSION(2,6,34) &&
 	    dev->uses_numbered_reports) {
@@ -748,9 +1603,110 @@ int HID_API_EXPORT hid_read_timeout(hid_device *dev, unsigned char *data, size_t
 		bytes_read--;
 	}
 
+	if (bytes_read > 0) {
+		STATS_ADD(dev, reports_received, 1);
+		STATS_ADD(dev, bytes_received, bytes_read);
+		if (dev->last_report)
+			histogram_record(dev, HID_HISTOGRAM_REPORT_INTERVAL, timestamp - dev->last_report);
+		dev->last_report = timestamp;
+		HID_PROBE3(report_receive, dev, bytes_read, timestamp);
+	}
+
+	if (bytes_read > 0 && dev->input_callback)
+		dev->input_callback(dev, data, bytes_read, timestamp, dev->input_callback_data);
+
 	return bytes_read;
 }
 
+/* Read one report from a device which is known to be readable (or in
+   blocking mode) and hand it to the input report callback. timestamp
+   (may be NULL) is set to the time the report was read. */
+static int read_report(hid_device *dev, unsigned char *data, size_t length, uint64_t *timestamp)
+{
+	int bytes_read;
+	uint64_t now;
+
+	bytes_read = read(dev->device_handle, data, length);
+	now = monotonic_ns();
+	STATS_ADD(dev, read_calls, 1);
+	if (bytes_read < 0 && (errno == EAGAIN || errno == EINPROGRESS))
+		bytes_read = 0;
+
+	if (timestamp)
+		*timestamp = now;
+
+	return deliver_report(dev, data, bytes_read, now);
+}
+
+/* Wait for a report to arrive. Returns 1 if one can be read, 0 on
+   timeout and -1 on error. */
+static int wait_for_input(hid_device *dev, int milliseconds)
+{
+	/* Milliseconds is either -1 (blocking), 0 (non-blocking) or > 0
+	   (contains a valid timeout). In all cases we want to call poll()
+	   and wait for data to arrive.  Don't rely on read() alone since
+	   some kernels don't seem to properly report device disconnection
+	   through read() when in non-blocking mode.  */
+	int ret;
+	struct pollfd fds;
+
+	fds.fd = dev->device_handle;
+	fds.events = POLLIN;
+	fds.revents = 0;
+	ret = poll(&fds, 1, milliseconds);
+	if (ret == -1 || ret == 0) {
+		/* Error or timeout */
+		return ret;
+	}
+
+	/* Check for errors on the file descriptor. This will
+	   indicate a device disconnection. */
+	if (fds.revents & (POLLERR | POLLHUP | POLLNVAL))
+		return -1;
+
+	return 1;
+}
+
+int HID_API_EXPORT hid_read_timestamped(hid_device *dev, unsigned char *data, size_t length, uint64_t *timestamp, int milliseconds)
+{
+	int ret = wait_for_input(dev, milliseconds);
+	if (ret <= 0)
+		return ret;
+
+	return read_report(dev, data, length, timestamp);
+}
+
+int HID_API_EXPORT hid_read_timeout(hid_device *dev, unsigned char *data, size_t length, int milliseconds)
+{
+	return hid_read_timestamped(dev, data, length, NULL, milliseconds);
+}
+
+int HID_API_EXPORT hid_read_batch(hid_device *dev, unsigned char *data, size_t stride, int max_reports, int *lengths, int milliseconds)
+{
+	int num_reports = 0;
+	int ret;
+
+	if (max_reports <= 0)
+		return 0;
+
+	ret = wait_for_input(dev, milliseconds);
+	if (ret <= 0)
+		return ret;
+
+	/* The device is non-blocking, so keep reading until the kernel
+	   has nothing left (read_report() returns 0 on EAGAIN). */
+	while (num_reports < max_reports) {
+		ret = read_report(dev, data + num_reports * stride, stride, NULL);
+		if (ret < 0)
+			return (num_reports > 0)? num_reports: -1;
+		if (ret == 0)
+			break;
+		lengths[num_reports++] = ret;
+	}
+
+	return num_reports;
+}
+
 int HID_API_EXPORT hid_read(hid_device *dev, unsigned char *data, size_t length)
 {
 	return hid_read_timeout(dev, data, length, (dev->blocking)? -1: 0);
@@ -772,21 +1728,938 @@ hid_handle_t HID_API_EXPORT hid_get_event_handle(hid_device *dev)
     return (hid_handle_t) ((intptr_t)dev->device_handle);
 }
 
-
-int HID_API_EXPORT hid_send_feature_report(hid_device *dev, const unsigned char *data, size_t length)
+int HID_API_EXPORT hid_get_stats(hid_device *dev, struct hid_device_stats *stats)
 {
-	int res;
+	stats->reports_received = __atomic_load_n(&dev->stats.reports_received, __ATOMIC_RELAXED);
+	stats->bytes_received = __atomic_load_n(&dev->stats.bytes_received, __ATOMIC_RELAXED);
+	stats->reports_dropped = __atomic_load_n(&dev->stats.reports_dropped, __ATOMIC_RELAXED);
+	stats->max_queue_depth = __atomic_load_n(&dev->stats.max_queue_depth, __ATOMIC_RELAXED);
+	stats->read_calls = __atomic_load_n(&dev->stats.read_calls, __ATOMIC_RELAXED);
+	stats->writes = __atomic_load_n(&dev->stats.writes, __ATOMIC_RELAXED);
+	stats->write_time_ns = __atomic_load_n(&dev->stats.write_time_ns, __ATOMIC_RELAXED);
+	stats->max_write_time_ns = __atomic_load_n(&dev->stats.max_write_time_ns, __ATOMIC_RELAXED);
+	stats->reports_parsed = __atomic_load_n(&dev->stats.reports_parsed, __ATOMIC_RELAXED);
+	stats->parse_time_ns = __atomic_load_n(&dev->stats.parse_time_ns, __ATOMIC_RELAXED);
+	stats->writes_replaced = __atomic_load_n(&dev->stats.writes_replaced, __ATOMIC_RELAXED);
+	stats->reports_coalesced = 0;
 
-	res = ioctl(dev->device_handle, HIDIOCSFEATURE(length), data);
-	if (res < 0)
-		perror("ioctl (SFEATURE)");
+	return 0;
+}
 
-	return res;
+void HID_API_EXPORT hid_stats_add_parse_time(hid_device *dev, uint64_t nanoseconds)
+{
+	STATS_ADD(dev, reports_parsed, 1);
+	STATS_ADD(dev, parse_time_ns, nanoseconds);
+	histogram_record(dev, HID_HISTOGRAM_PARSE, nanoseconds);
 }
 
-int HID_API_EXPORT hid_get_feature_report(hid_device *dev, unsigned char *data, size_t length)
+int HID_API_EXPORT hid_set_parse_timing(hid_device *dev, int enable)
 {
-	int res;
+	__atomic_store_n(&dev->parse_timing, enable != 0, __ATOMIC_RELAXED);
+	return 0;
+}
+
+int HID_API_EXPORT hid_get_parse_timing(hid_device *dev)
+{
+	return __atomic_load_n(&dev->parse_timing, __ATOMIC_RELAXED) ||
+		__atomic_load_n(&dev->histograms_enabled, __ATOMIC_RELAXED);
+}
+
+int HID_API_EXPORT hid_set_histograms(hid_device *dev, int enable)
+{
+	if (enable && !dev->histograms) {
+		dev->histograms = calloc(HID_HISTOGRAM_COUNT, sizeof(struct hid_histogram));
+		if (!dev->histograms)
+			return -1;
+	}
+	__atomic_store_n(&dev->histograms_enabled, enable != 0, __ATOMIC_RELEASE);
+	return 0;
+}
+
+int HID_API_EXPORT hid_get_histogram(hid_device *dev, int type, struct hid_histogram *histogram)
+{
+	struct hid_histogram *h;
+	int i;
+
+	if (type < 0 || type >= HID_HISTOGRAM_COUNT || !dev->histograms)
+		return -1;
+
+	h = dev->histograms + type;
+	histogram->count = __atomic_load_n(&h->count, __ATOMIC_RELAXED);
+	for (i = 0; i < HID_HISTOGRAM_BUCKETS; i++)
+		histogram->buckets[i] = __atomic_load_n(&h->buckets[i], __ATOMIC_RELAXED);
+
+	return 0;
+}
+
+uint64_t HID_API_EXPORT hid_histogram_bucket_start(int bucket)
+{
+	if (bucket < 4)
+		return (bucket < 0)? 0: bucket;
+	if (bucket >= HID_HISTOGRAM_BUCKETS)
+		return UINT64_MAX;
+	return (uint64_t)(4 + bucket % 4) << (bucket / 4 - 1);
+}
+
+int HID_API_EXPORT hid_set_input_report_callback(hid_device *dev, hid_input_report_callback callback, void *user_data, int queue_reports)
+{
+	/* There is no read thread and nothing is queued in userspace, so
+	   queue_reports doesn't change anything here: the report is always
+	   returned by hid_read() as well. */
+	dev->input_callback_data = user_data;
+	dev->input_callback = callback;
+	return 0;
+}
+
+int HID_API_EXPORT hid_set_input_transfers(int count)
+{
+	/* hidraw has no transfers, the kernel driver does the USB I/O. */
+	errno = ENOTSUP;
+	return -1;
+}
+
+int HID_API_EXPORT hid_set_input_queue(hid_device *dev, int capacity, enum hid_queue_policy policy, hid_queue_overflow_callback callback, void *user_data)
+{
+	/* The reports are queued by the kernel, in the hidraw driver. */
+	errno = ENOTSUP;
+	return -1;
+}
+
+#ifdef HAVE_IO_URING
+/* user_data of the POLL_ADD which is linked in front of every read.
+   Timeouts are tagged with URING_TIMEOUT_TAG and a sequence number,
+   cancel requests use 0. */
+#define URING_POLL_TAG 0x1
+#define URING_TIMEOUT_TAG 0x2
+
+static int uring_setup(struct uring *ring, unsigned entries)
+{
+	struct io_uring_params p;
+
+	memset(&p, 0, sizeof(p));
+	ring->fd = syscall(__NR_io_uring_setup, entries, &p);
+	if (ring->fd < 0)
+		return -1;
+
+	ring->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	ring->cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		/* Both rings are in one mapping. */
+		if (ring->cq_ring_size > ring->sq_ring_size)
+			ring->sq_ring_size = ring->cq_ring_size;
+		ring->cq_ring_size = 0;
+	}
+	ring->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+
+	ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+	if (ring->sq_ring == MAP_FAILED)
+		goto err_close;
+
+	ring->cq_ring = ring->sq_ring;
+	if (ring->cq_ring_size) {
+		ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+		if (ring->cq_ring == MAP_FAILED)
+			goto err_unmap_sq;
+	}
+
+	ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+	if (ring->sqes == MAP_FAILED)
+		goto err_unmap_cq;
+
+	ring->sq_entries = p.sq_entries;
+	ring->sq_head = (unsigned *)((char *)ring->sq_ring + p.sq_off.head);
+	ring->sq_tail = (unsigned *)((char *)ring->sq_ring + p.sq_off.tail);
+	ring->sq_mask = *(unsigned *)((char *)ring->sq_ring + p.sq_off.ring_mask);
+	ring->sq_array = (unsigned *)((char *)ring->sq_ring + p.sq_off.array);
+	ring->sqe_tail = *ring->sq_tail;
+	ring->cq_head = (unsigned *)((char *)ring->cq_ring + p.cq_off.head);
+	ring->cq_tail = (unsigned *)((char *)ring->cq_ring + p.cq_off.tail);
+	ring->cq_mask = *(unsigned *)((char *)ring->cq_ring + p.cq_off.ring_mask);
+	ring->cqes = (struct io_uring_cqe *)((char *)ring->cq_ring + p.cq_off.cqes);
+
+	return 0;
+
+err_unmap_cq:
+	if (ring->cq_ring_size)
+		munmap(ring->cq_ring, ring->cq_ring_size);
+err_unmap_sq:
+	munmap(ring->sq_ring, ring->sq_ring_size);
+err_close:
+	close(ring->fd);
+	return -1;
+}
+
+static void uring_teardown(struct uring *ring)
+{
+	munmap(ring->sqes, ring->sqes_size);
+	if (ring->cq_ring_size)
+		munmap(ring->cq_ring, ring->cq_ring_size);
+	munmap(ring->sq_ring, ring->sq_ring_size);
+	close(ring->fd);
+}
+
+/* Submit everything queued with uring_get_sqe(), and wait for at least
+   min_complete completions. */
+static int uring_enter(struct uring *ring, unsigned min_complete)
+{
+	unsigned to_submit = ring->sqe_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+
+	if (to_submit == 0 && min_complete == 0)
+		return 0;
+
+	__atomic_store_n(ring->sq_tail, ring->sqe_tail, __ATOMIC_RELEASE);
+	return syscall(__NR_io_uring_enter, ring->fd, to_submit, min_complete,
+		(min_complete > 0)? IORING_ENTER_GETEVENTS: 0, NULL, 0);
+}
+
+/* Make room for count more submission queue entries, submitting the
+   queued ones if the queue is too full. */
+static int uring_reserve(struct uring *ring, unsigned count)
+{
+	if (ring->sqe_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) + count > ring->sq_entries) {
+		if (uring_enter(ring, 0) < 0)
+			return -1;
+		if (ring->sqe_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) + count > ring->sq_entries)
+			return -1;
+	}
+	return 0;
+}
+
+/* Get a cleared submission queue entry. It goes to the kernel with the
+   next uring_enter(), or straight away if the queue is full. */
+static struct io_uring_sqe *uring_get_sqe(struct uring *ring)
+{
+	struct io_uring_sqe *sqe;
+	unsigned idx;
+
+	if (uring_reserve(ring, 1) < 0)
+		return NULL;
+
+	idx = ring->sqe_tail & ring->sq_mask;
+	sqe = &ring->sqes[idx];
+	memset(sqe, 0, sizeof(*sqe));
+	ring->sq_array[idx] = idx;
+	ring->sqe_tail++;
+
+	return sqe;
+}
+
+/* Queue the next read for a device. The device is opened O_NONBLOCK, on
+   which io_uring reads fail with EAGAIN rather than wait, so the read is
+   linked behind a POLL_ADD for POLLIN. Both entries are reserved first,
+   a poll must never be left without its read. */
+static int uring_submit_read(struct uring *ring, struct uring_slot *slot)
+{
+	struct io_uring_sqe *sqe;
+
+	if (uring_reserve(ring, 2) < 0)
+		return -1;
+
+	sqe = uring_get_sqe(ring);
+	sqe->opcode = IORING_OP_POLL_ADD;
+	sqe->fd = slot->dev->device_handle;
+	sqe->poll32_events = POLLIN;
+	sqe->flags = IOSQE_IO_LINK;
+	sqe->user_data = (__u64)(uintptr_t)slot | URING_POLL_TAG;
+
+	sqe = uring_get_sqe(ring);
+	sqe->opcode = IORING_OP_READ;
+	sqe->fd = slot->dev->device_handle;
+	sqe->addr = (__u64)(uintptr_t)slot->buf;
+	sqe->len = sizeof(slot->buf);
+	sqe->user_data = (__u64)(uintptr_t)slot;
+
+	return 0;
+}
+
+static int uring_cancel_read(struct uring *ring, struct uring_slot *slot)
+{
+	struct io_uring_sqe *sqe;
+
+	/* Cancelling the poll also cancels the read linked to it. If the
+	   poll has already fired, the non-blocking read finishes on its
+	   own. */
+	slot->removed = 1;
+	sqe = uring_get_sqe(ring);
+	if (!sqe)
+		return -1;
+	sqe->opcode = IORING_OP_ASYNC_CANCEL;
+	sqe->fd = -1;
+	sqe->addr = (__u64)(uintptr_t)slot | URING_POLL_TAG;
+
+	return (uring_enter(ring, 0) < 0)? -1: 0;
+}
+
+static void uring_free_slot(hid_reactor *reactor, struct uring_slot *slot)
+{
+	struct uring_slot **s = &reactor->slots;
+
+	while (*s != slot)
+		s = &(*s)->next;
+	*s = slot->next;
+	free(slot);
+}
+
+/* Queue the read of a slot again. If that fails nothing is left in
+   flight for it, so it is dropped like a device which is gone. */
+static void uring_resubmit_read(hid_reactor *reactor, struct uring_slot *slot)
+{
+	if (uring_submit_read(&reactor->ring, slot) < 0)
+		uring_free_slot(reactor, slot);
+}
+
+/* Go through all completions. Reports are passed to the input report
+   callbacks and the read is queued again right away. Returns the number
+   of reports dispatched, *reads is increased by the number of finished
+   reads. */
+static int uring_reap(hid_reactor *reactor, int *reads)
+{
+	struct uring *ring = &reactor->ring;
+	unsigned head = *ring->cq_head;
+	unsigned tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+	int dispatched = 0;
+
+	while (head != tail) {
+		struct io_uring_cqe *cqe = &ring->cqes[head & ring->cq_mask];
+		struct uring_slot *slot = (struct uring_slot *)(uintptr_t)cqe->user_data;
+		int res = cqe->res;
+
+		head++;
+
+		if (reactor->timeout_tag && cqe->user_data == reactor->timeout_tag) {
+			/* The timeout of uring_dispatch() has expired. */
+			reactor->timeout_tag = 0;
+			continue;
+		}
+
+		/* Cancels, polls and old timeouts. The read which is
+		   linked to a poll always completes after it. */
+		if (!slot || ((uintptr_t)slot & (URING_POLL_TAG | URING_TIMEOUT_TAG)))
+			continue;
+
+		(*reads)++;
+
+		if (slot->removed) {
+			uring_free_slot(reactor, slot);
+			continue;
+		}
+
+		if (res == -EAGAIN || res == -EINTR) {
+			/* Nothing there after all. */
+			uring_resubmit_read(reactor, slot);
+			continue;
+		}
+
+		if (res <= 0) {
+			/* The device is gone, just like hid_reactor_dispatch()
+			   removes it from the epoll set. */
+			uring_free_slot(reactor, slot);
+			continue;
+		}
+
+		/* The completion time isn't known, this is as close as it
+		   gets. */
+		if (deliver_report(slot->dev, slot->buf, res, monotonic_ns()) > 0)
+			dispatched++;
+
+		/* The callback may have removed (and closed) the device,
+		   nothing is in flight for it then. */
+		if (slot->removed) {
+			uring_free_slot(reactor, slot);
+			continue;
+		}
+		uring_resubmit_read(reactor, slot);
+	}
+
+	__atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+
+	return dispatched;
+}
+
+static int uring_dispatch(hid_reactor *reactor, int milliseconds)
+{
+	struct uring *ring = &reactor->ring;
+	struct __kernel_timespec ts;
+	struct io_uring_sqe *sqe;
+	int reads = 0;
+	int dispatched;
+
+	/* Submit the reads queued since the last call and take whatever
+	   has finished already. */
+	if (uring_enter(ring, 0) < 0 && errno != EINTR)
+		return -1;
+	dispatched = uring_reap(reactor, &reads);
+	if (reads > 0 || milliseconds == 0)
+		return dispatched;
+
+	if (milliseconds > 0) {
+		/* A plain timer, it only completes with -ETIME once it
+		   expires. Any poll completing before would end a timeout
+		   with a completion count, without a read to reap. */
+		sqe = uring_get_sqe(ring);
+		if (!sqe)
+			return -1;
+		ts.tv_sec = milliseconds / 1000;
+		ts.tv_nsec = (milliseconds % 1000) * 1000000;
+		reactor->timeout_tag = ((__u64)++reactor->timeouts << 2) | URING_TIMEOUT_TAG;
+		sqe->opcode = IORING_OP_TIMEOUT;
+		sqe->fd = -1;
+		sqe->addr = (__u64)(uintptr_t)&ts;
+		sqe->len = 1;
+		sqe->user_data = reactor->timeout_tag;
+	}
+
+	/* Polls complete before their reads, so wait until a read has
+	   finished or the timeout has expired. */
+	while (reads == 0 && (milliseconds < 0 || reactor->timeout_tag)) {
+		if (uring_enter(ring, 1) < 0) {
+			if (errno != EINTR)
+				dispatched = -1;
+			break;
+		}
+		dispatched += uring_reap(reactor, &reads);
+	}
+
+	if (reactor->timeout_tag) {
+		/* Still pending, its completion is ignored from now on. */
+		sqe = uring_get_sqe(ring);
+		if (sqe) {
+			sqe->opcode = IORING_OP_TIMEOUT_REMOVE;
+			sqe->fd = -1;
+			sqe->addr = reactor->timeout_tag;
+		}
+		reactor->timeout_tag = 0;
+		uring_enter(ring, 0);
+	}
+
+	return dispatched;
+}
+#endif /* HAVE_IO_URING */
+
+hid_reactor * HID_API_EXPORT hid_reactor_new(void)
+{
+	hid_reactor *reactor = calloc(1, sizeof(hid_reactor));
+	if (!reactor)
+		return NULL;
+
+	reactor->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (reactor->epoll_fd < 0) {
+		free(reactor);
+		return NULL;
+	}
+
+	return reactor;
+}
+
+hid_reactor * HID_API_EXPORT hid_reactor_new_io_uring(void)
+{
+#ifdef HAVE_IO_URING
+	hid_reactor *reactor = calloc(1, sizeof(hid_reactor));
+	if (!reactor)
+		return NULL;
+
+	if (uring_setup(&reactor->ring, URING_ENTRIES) == 0) {
+		reactor->epoll_fd = -1;
+		reactor->use_uring = 1;
+		return reactor;
+	}
+
+	/* No io_uring in this kernel (or not allowed to use it). */
+	free(reactor);
+#endif
+	return hid_reactor_new();
+}
+
+void HID_API_EXPORT hid_reactor_free(hid_reactor *reactor)
+{
+	if (!reactor)
+		return;
+#ifdef HAVE_IO_URING
+	if (reactor->use_uring) {
+		struct uring_slot *slot;
+		int cancelled = 1;
+
+		/* The kernel may still write into the slot buffers until
+		   their reads have completed. If a cancel can't be queued,
+		   that read would only complete with the next report, so
+		   closing the ring has to cancel them all instead. */
+		for (slot = reactor->slots; slot; slot = slot->next) {
+			if (!slot->removed && uring_cancel_read(&reactor->ring, slot) < 0)
+				cancelled = 0;
+		}
+		while (cancelled && reactor->slots) {
+			int reads = 0;
+
+			if (uring_enter(&reactor->ring, 1) < 0 && errno != EINTR)
+				break;
+			uring_reap(reactor, &reads);
+		}
+		uring_teardown(&reactor->ring);
+		while (reactor->slots)
+			uring_free_slot(reactor, reactor->slots);
+		free(reactor);
+		return;
+	}
+#endif
+	close(reactor->epoll_fd);
+	free(reactor);
+}
+
+int HID_API_EXPORT hid_reactor_add(hid_reactor *reactor, hid_device *dev)
+{
+	struct epoll_event ev;
+
+#ifdef HAVE_IO_URING
+	if (reactor->use_uring) {
+		struct uring_slot *slot = calloc(1, sizeof(struct uring_slot));
+		if (!slot)
+			return -1;
+		slot->dev = dev;
+		slot->next = reactor->slots;
+		reactor->slots = slot;
+
+		/* Submitted with the next hid_reactor_dispatch(). */
+		if (uring_submit_read(&reactor->ring, slot) < 0) {
+			uring_free_slot(reactor, slot);
+			return -1;
+		}
+		return 0;
+	}
+#endif
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.ptr = dev;
+
+	return epoll_ctl(reactor->epoll_fd, EPOLL_CTL_ADD, dev->device_handle, &ev);
+}
+
+int HID_API_EXPORT hid_reactor_remove(hid_reactor *reactor, hid_device *dev)
+{
+	/* The event argument is ignored, but kernels before 2.6.9 want a
+	   non-NULL pointer. */
+	struct epoll_event ev;
+
+#ifdef HAVE_IO_URING
+	if (reactor->use_uring) {
+		struct uring_slot *slot;
+
+		for (slot = reactor->slots; slot; slot = slot->next) {
+			if (slot->dev == dev && !slot->removed)
+				return uring_cancel_read(&reactor->ring, slot);
+		}
+		errno = ENOENT;
+		return -1;
+	}
+#endif
+
+	memset(&ev, 0, sizeof(ev));
+	return epoll_ctl(reactor->epoll_fd, EPOLL_CTL_DEL, dev->device_handle, &ev);
+}
+
+int HID_API_EXPORT hid_reactor_wait(hid_reactor *reactor, hid_device **ready, int max_ready, int milliseconds)
+{
+	struct epoll_event events[REACTOR_MAX_EVENTS];
+	int i, n;
+
+	if (max_ready > REACTOR_MAX_EVENTS)
+		max_ready = REACTOR_MAX_EVENTS;
+	if (max_ready <= 0 || reactor->use_uring) {
+		/* An io_uring reactor always has a read outstanding, so
+		   there is nothing left for the caller to read. */
+		errno = EINVAL;
+		return -1;
+	}
+
+	n = epoll_wait(reactor->epoll_fd, events, max_ready, milliseconds);
+	if (n < 0)
+		return (errno == EINTR)? 0: -1;
+
+	for (i = 0; i < n; i++)
+		ready[i] = events[i].data.ptr;
+
+	return n;
+}
+
+int HID_API_EXPORT hid_reactor_dispatch(hid_reactor *reactor, int milliseconds)
+{
+	struct epoll_event events[REACTOR_MAX_EVENTS];
+	int i, n;
+	int dispatched = 0;
+
+#ifdef HAVE_IO_URING
+	if (reactor->use_uring)
+		return uring_dispatch(reactor, milliseconds);
+#endif
+
+	n = epoll_wait(reactor->epoll_fd, events, REACTOR_MAX_EVENTS, milliseconds);
+	if (n < 0)
+		return (errno == EINTR)? 0: -1;
+
+	for (i = 0; i < n; i++) {
+		hid_device *dev = events[i].data.ptr;
+		int res = -1;
+
+		/* POLLHUP/POLLERR mean the device is gone, see
+		   hid_read_timeout(). */
+		if (!(events[i].events & (EPOLLERR | EPOLLHUP)))
+			res = read_report(dev, reactor->buf, sizeof(reactor->buf), NULL);
+
+		if (res < 0) {
+			/* Take it out of the set, otherwise every following
+			   wait returns straight away for it. */
+			hid_reactor_remove(reactor, dev);
+			continue;
+		}
+		if (res > 0)
+			dispatched++;
+	}
+
+	return dispatched;
+}
+
+
+static int hotplug_match(struct hotplug_callback *cb, struct hid_device_info *info, hid_hotplug_event event)
+{
+	return !cb->removed && (cb->events & event) &&
+		(cb->vendor_id == 0x0 || cb->vendor_id == info->vendor_id) &&
+		(cb->product_id == 0x0 || cb->product_id == info->product_id) &&
+		(cb->usage_page == 0x0 || cb->usage_page == info->usage_page) &&
+		(cb->usage == 0x0 || cb->usage == info->usage);
+}
+
+/* Call the callbacks which match. If only is not NULL, no other
+   callback is considered. */
+static void hotplug_notify(struct hotplug_callback *only, struct hid_device_info *info, hid_hotplug_event event)
+{
+	struct hotplug_callback *cb;
+
+	/* Callbacks which deregister themselves are only marked as removed
+	   until the outermost call is done. */
+	hotplug.running++;
+	for (cb = hotplug.callbacks; cb; cb = cb->next) {
+		if ((!only || cb == only) && hotplug_match(cb, info, event))
+			cb->callback(cb->handle, info, event, cb->user_data);
+	}
+	hotplug.running--;
+
+	if (!hotplug.running) {
+		struct hotplug_callback **c = &hotplug.callbacks;
+		while (*c) {
+			struct hotplug_callback *gone = *c;
+			if (!gone->removed) {
+				c = &gone->next;
+				continue;
+			}
+			*c = gone->next;
+			free(gone);
+		}
+	}
+}
+
+/* hotplug_notify() for each record of a hidraw node, see
+   add_usages(). */
+static void hotplug_notify_all(struct hotplug_callback *only, struct hid_device_info *info, hid_hotplug_event event)
+{
+	/* The callbacks get the records one by one. */
+	while (info) {
+		struct hid_device_info *next = info->next;
+		info->next = NULL;
+		hotplug_notify(only, info, event);
+		info->next = next;
+		info = next;
+	}
+}
+
+/* Returns 1 if the device is new. */
+static int hotplug_device_add(struct udev_device *raw_dev)
+{
+	struct enum_cache_entry **e = &hotplug.devices;
+	struct enum_cache_entry *entry;
+	struct hid_device_info *info;
+	const char *syspath = udev_device_get_syspath(raw_dev);
+
+	/* The monitor is started before the scan in hotplug_start(), so a
+	   device can show up in both. */
+	for (; *e; e = &(*e)->next) {
+		if (strcmp((*e)->syspath, syspath) == 0)
+			return 0;
+	}
+
+	info = create_device_info(raw_dev, 0, 0);
+	if (!info)
+		return 0;
+
+	entry = malloc(sizeof(struct enum_cache_entry));
+	if (!entry) {
+		hid_free_enumeration(info);
+		return 0;
+	}
+	entry->syspath = strdup(syspath);
+	entry->info = info;
+	entry->next = NULL;
+	*e = entry;
+
+	hotplug_notify_all(NULL, info, HID_HOTPLUG_EVENT_DEVICE_ARRIVED);
+	return 1;
+}
+
+/* Returns 1 if the device was known. */
+static int hotplug_device_remove(const char *syspath)
+{
+	struct enum_cache_entry **e = &hotplug.devices;
+
+	while (*e) {
+		if (strcmp((*e)->syspath, syspath) == 0) {
+			struct enum_cache_entry *gone = *e;
+			*e = gone->next;
+			hotplug_notify_all(NULL, gone->info, HID_HOTPLUG_EVENT_DEVICE_LEFT);
+			hid_free_enumeration(gone->info);
+			free(gone->syspath);
+			free(gone);
+			return 1;
+		}
+		e = &(*e)->next;
+	}
+	return 0;
+}
+
+/* Bring hotplug.devices in line with the hidraw nodes which are there
+   right now, reporting the differences. Returns the number of devices
+   which came or went. */
+static int hotplug_scan(void)
+{
+	struct udev_enumerate *enumerate;
+	struct udev_list_entry *devices, *dev_list_entry;
+	struct enum_cache_entry *e, *next;
+	int changed = 0;
+
+	enumerate = udev_enumerate_new(hotplug.udev);
+	udev_enumerate_add_match_subsystem(enumerate, "hidraw");
+	udev_enumerate_scan_devices(enumerate);
+	devices = udev_enumerate_get_list_entry(enumerate);
+
+	for (e = hotplug.devices; e; e = next) {
+		next = e->next;
+		if (!udev_list_entry_get_by_name(devices, e->syspath))
+			changed += hotplug_device_remove(e->syspath);
+	}
+
+	udev_list_entry_foreach(dev_list_entry, devices) {
+		struct udev_device *raw_dev = udev_device_new_from_syspath(hotplug.udev,
+			udev_list_entry_get_name(dev_list_entry));
+		if (raw_dev) {
+			changed += hotplug_device_add(raw_dev);
+			udev_device_unref(raw_dev);
+		}
+	}
+	udev_enumerate_unref(enumerate);
+
+	return changed;
+}
+
+static void hotplug_stop(void)
+{
+	while (hotplug.callbacks) {
+		struct hotplug_callback *next = hotplug.callbacks->next;
+		free(hotplug.callbacks);
+		hotplug.callbacks = next;
+	}
+	while (hotplug.devices) {
+		struct enum_cache_entry *next = hotplug.devices->next;
+		hid_free_enumeration(hotplug.devices->info);
+		free(hotplug.devices->syspath);
+		free(hotplug.devices);
+		hotplug.devices = next;
+	}
+
+	if (hotplug.monitor)
+		udev_monitor_unref(hotplug.monitor);
+	if (hotplug.udev)
+		udev_unref(hotplug.udev);
+	hotplug.monitor = NULL;
+	hotplug.udev = NULL;
+}
+
+static int hotplug_start(void)
+{
+	hotplug.udev = udev_new();
+	if (!hotplug.udev) {
+		printf("Can't create udev\n");
+		return -1;
+	}
+
+	hotplug.monitor = udev_monitor_new_from_netlink(hotplug.udev, "udev");
+	if (!hotplug.monitor ||
+	    udev_monitor_filter_add_match_subsystem_devtype(hotplug.monitor, "hidraw", NULL) < 0 ||
+	    udev_monitor_enable_receiving(hotplug.monitor) < 0) {
+		hotplug_stop();
+		return -1;
+	}
+	/* See hid_hotplug_handle_events() for what happens when it
+	   overflows anyway. */
+	udev_monitor_set_receive_buffer_size(hotplug.monitor, MONITOR_BUFFER_SIZE);
+
+	/* Remember what is connected already, so removals can be reported
+	   with the full record and HID_HOTPLUG_ENUMERATE works. Nobody is
+	   registered yet, so nothing is reported here. */
+	hotplug_scan();
+
+	return 0;
+}
+
+/* Stop listening once the last callback is gone, so that
+   hid_hotplug_get_fd() returns -1 again. Not while callbacks run, they
+   are only marked as removed then. */
+static void hotplug_stop_unused(void)
+{
+	if (!hotplug.running && !hotplug.callbacks)
+		hotplug_stop();
+}
+
+int HID_API_EXPORT hid_hotplug_register(unsigned short vendor_id, unsigned short product_id, unsigned short usage_page, unsigned short usage, int events, int flags, hid_hotplug_callback callback, void *user_data, hid_hotplug_handle *handle)
+{
+	struct hotplug_callback *cb, **c;
+
+	if (!callback || !(events & (HID_HOTPLUG_EVENT_DEVICE_ARRIVED | HID_HOTPLUG_EVENT_DEVICE_LEFT))) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	hid_init();
+
+	if (!hotplug.monitor && hotplug_start() < 0)
+		return -1;
+
+	cb = calloc(1, sizeof(struct hotplug_callback));
+	if (!cb) {
+		hotplug_stop_unused();
+		return -1;
+	}
+	cb->handle = ++hotplug.next_handle;
+	cb->vendor_id = vendor_id;
+	cb->product_id = product_id;
+	cb->usage_page = usage_page;
+	cb->usage = usage;
+	cb->events = events;
+	cb->callback = callback;
+	cb->user_data = user_data;
+
+	for (c = &hotplug.callbacks; *c; c = &(*c)->next)
+		;
+	*c = cb;
+
+	if (handle)
+		*handle = cb->handle;
+
+	if (flags & HID_HOTPLUG_ENUMERATE) {
+		struct enum_cache_entry *e;
+		for (e = hotplug.devices; e; e = e->next)
+			hotplug_notify_all(cb, e->info, HID_HOTPLUG_EVENT_DEVICE_ARRIVED);
+	}
+
+	/* The callback may have deregistered itself. */
+	hotplug_stop_unused();
+
+	return 0;
+}
+
+int HID_API_EXPORT hid_hotplug_deregister(hid_hotplug_handle handle)
+{
+	struct hotplug_callback **c;
+
+	for (c = &hotplug.callbacks; *c; c = &(*c)->next) {
+		struct hotplug_callback *cb = *c;
+		if (cb->handle != handle || cb->removed)
+			continue;
+
+		if (hotplug.running) {
+			/* Freed by hotplug_notify(). */
+			cb->removed = 1;
+		}
+		else {
+			*c = cb->next;
+			free(cb);
+			hotplug_stop_unused();
+		}
+		return 0;
+	}
+
+	errno = ENOENT;
+	return -1;
+}
+
+int HID_API_EXPORT hid_hotplug_get_fd(void)
+{
+	return hotplug.monitor? udev_monitor_get_fd(hotplug.monitor): -1;
+}
+
+int HID_API_EXPORT hid_hotplug_handle_events(void)
+{
+	struct udev_device *raw_dev;
+	int handled = 0;
+	int overflow = 0;
+
+	if (!hotplug.monitor) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	/* The monitor socket is non-blocking. */
+	for (;;) {
+		const char *action;
+
+		errno = 0;
+		raw_dev = udev_monitor_receive_device(hotplug.monitor);
+		if (!raw_dev) {
+			/* Events were lost, see enum_cache_update(). */
+			if (errno == ENOBUFS) {
+				overflow = 1;
+				continue;
+			}
+			break;
+		}
+
+		action = udev_device_get_action(raw_dev);
+		if (action && strcmp(action, "remove") == 0) {
+			hotplug_device_remove(udev_device_get_syspath(raw_dev));
+			handled++;
+		}
+		else if (action && strcmp(action, "add") == 0) {
+			hotplug_device_add(raw_dev);
+			handled++;
+		}
+
+		udev_device_unref(raw_dev);
+	}
+
+	/* Report what the lost events would have. */
+	if (overflow)
+		handled += hotplug_scan();
+
+	/* The callbacks may have deregistered themselves. */
+	hotplug_stop_unused();
+
+	return handled;
+}
+
+int HID_API_EXPORT hid_send_feature_report(hid_device *dev, const unsigned char *data, size_t length)
+{
+	int res;
+
+	res = ioctl(dev->device_handle, HIDIOCSFEATURE(length), data);
+	if (res < 0)
+		perror("ioctl (SFEATURE)");
+
+	return res;
+}
+
+int HID_API_EXPORT hid_get_feature_report(hid_device *dev, unsigned char *data, size_t length)
+{
+	int res;
 
 	res = ioctl(dev->device_handle, HIDIOCGFEATURE(length), data);
 	if (res < 0)
@@ -799,9 +2672,15 @@ int HID_API_EXPORT hid_get_feature_report(hid_device *dev, unsigned char *data,
 
 void HID_API_EXPORT hid_close(hid_device *dev)
 {
+	int i;
+
 	if (!dev)
 		return;
+	writer_stop(dev);
 	close(dev->device_handle);
+	for (i = 0; i < DEVICE_STRING_COUNT; i++)
+		free(dev->strings[i]);
+	free(dev->histograms);
 	free(dev);
 }
 